@@ -0,0 +1,367 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+//
+// A load generator for main. Each connection runs a random mix of
+// commands in a closed loop, following each one with a "say" that
+// it waits to hear back from its chat room before sending the next.
+// That round trip is the latency that gets reported.
+#include "make-unique.hpp"
+#include "net.hpp"
+#include "cli.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// What the connections of one thread saw.
+struct Results
+{
+    // round trips, in microseconds
+    std::vector<uint64_t> latencies;
+    uint64_t commands;
+    // connections that went away before the end
+    uint64_t lost;
+
+    Results()
+    : latencies()
+    , commands()
+    , lost()
+    {}
+};
+
+// relative weights of the commands that go before each "say"
+struct Mix
+{
+    unsigned say, nick, join, turn;
+};
+
+static
+Mix mix = {90, 2, 3, 5};
+static
+unsigned rooms = 0;
+static
+Clock::time_point deadline;
+
+class BenchClient : public net::LineHandler
+{
+    const unsigned id;
+    Results *results;
+    uint64_t seq;
+    Clock::time_point sent;
+    uint32_t rng;
+    unsigned renames;
+    bool finished;
+
+    uint32_t random();
+    void send_next();
+public:
+    BenchClient(unsigned i, Results *r)
+    : id(i)
+    , results(r)
+    , seq()
+    , sent(Clock::now())
+    , rng(i * 2654435761u + 1)
+    , renames()
+    , finished()
+    {}
+
+    ~BenchClient()
+    {
+        if (not finished)
+            ++results->lost;
+    }
+
+    // What to send as soon as it connects: the same as a command
+    // would, but without a timed reply.
+    std::string hello()
+    {
+        return "nick b" + std::to_string(id) + "\n"
+            + "join r" + std::to_string(id % rooms) + "\n"
+            + "say #" + std::to_string(id) + ":0\n";
+    }
+
+    void handle(const_string line) override;
+};
+
+uint32_t BenchClient::random()
+{
+    // xorshift32
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+void BenchClient::send_next()
+{
+    std::string out;
+    unsigned total = mix.say + mix.nick + mix.join + mix.turn;
+    unsigned r = total ? random() % total : 0;
+    if (r < mix.say)
+        ;
+    else if ((r -= mix.say) < mix.nick)
+        out = "nick b" + std::to_string(id) + "." + std::to_string(++renames) + "\n";
+    else if ((r -= mix.nick) < mix.join)
+        out = "join r" + std::to_string(random() % rooms) + "\n";
+    else
+        out = "turn\n";
+    if (not out.empty())
+        ++results->commands;
+    ++seq;
+    out += "say #" + std::to_string(id) + ":" + std::to_string(seq) + "\n";
+    ++results->commands;
+    sent = Clock::now();
+    this->wbh->write(const_string(out.data(), out.size()));
+}
+
+void BenchClient::handle(const_string line)
+{
+    // Everything in the room is heard, but only our own "#id:seq"
+    // (of the say in flight) counts.
+    const char *hash = static_cast<const char *>(
+            memchr(line.data(), '#', line.size()));
+    if (not hash)
+        return;
+    const char *end = line.data() + line.size();
+    unsigned long long who = 0, n = 0;
+    const char *p = hash + 1;
+    for (; p != end and *p >= '0' and *p <= '9'; ++p)
+        who = who * 10 + (*p - '0');
+    if (p == end or *p != ':' or who != id)
+        return;
+    for (++p; p != end and *p >= '0' and *p <= '9'; ++p)
+        n = n * 10 + (*p - '0');
+    if (n != seq)
+        return;
+
+    Clock::time_point now = Clock::now();
+    // the first one includes connecting everything else
+    if (seq)
+        results->latencies.push_back(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - sent).count());
+    if (now >= deadline)
+    {
+        finished = true;
+        this->wbh->hang_up();
+        return;
+    }
+    send_next();
+}
+
+static
+int connect_tcp(uint16_t port, unsigned i)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    // The server names connections by address, and won't have
+    // two with the same name, so give each its own.
+    sockaddr_in from {};
+    from.sin_family = AF_INET;
+    from.sin_addr.s_addr = htonl(0x7f010000 + i + 1);
+    sockaddr_in to {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int one = 1;
+    if (bind(fd, reinterpret_cast<sockaddr *>(&from), sizeof(from)) == -1
+            or connect(fd, reinterpret_cast<sockaddr *>(&to), sizeof(to)) == -1
+            or setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static
+int connect_unix(const std::string& path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    sockaddr_un to {};
+    to.sun_family = AF_UNIX;
+    strncpy(to.sun_path, path.c_str(), sizeof(to.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&to), sizeof(to)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static
+bool extract_mix(const char *arg, Mix *out)
+{
+    std::string s = arg;
+    std::replace(s.begin(), s.end(), ',', ' ');
+    return cli::extract(const_string(s.data(), s.size()),
+            &out->say, &out->nick, &out->join, &out->turn)
+        and out->say;
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 0;
+    std::string unix_path;
+    unsigned connections = 1000;
+    unsigned threads = 1;
+    unsigned seconds = 10;
+    net::Backend backend = net::Backend::EPOLL;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool ok = ++i != argc;
+        if (arg == "--help")
+        {
+            std::cout << "Usage: ./bench (--port <number> | --unix <path>) [options]\n";
+            std::cout << "Connects to a server (./main) on the loopback interface,\n";
+            std::cout << "and keeps it busy with commands, then reports how it went.\n";
+            std::cout << '\n';
+            std::cout << "  --connections <number>   (default 1000)\n";
+            std::cout << "  --threads <number>       (default 1)\n";
+            std::cout << "  --seconds <number>       (default 10)\n";
+            std::cout << "  --rooms <number>         chat rooms to spread over\n";
+            std::cout << "                           (default 1 per 8 connections)\n";
+            std::cout << "  --mix <say,nick,join,turn>\n";
+            std::cout << "    relative weights of each command (default 90,2,3,5)\n";
+            std::cout << "  --backend epoll|uring\n";
+            return 0;
+        }
+        if (arg == "--port")
+            ok = ok and cli::extract(argv[i], &port) and port;
+        else if (arg == "--unix")
+            ok = ok and (unix_path = argv[i], not unix_path.empty());
+        else if (arg == "--connections")
+            ok = ok and cli::extract(argv[i], &connections) and connections;
+        else if (arg == "--threads")
+            ok = ok and cli::extract(argv[i], &threads) and threads;
+        else if (arg == "--seconds")
+            ok = ok and cli::extract(argv[i], &seconds) and seconds;
+        else if (arg == "--rooms")
+            ok = ok and cli::extract(argv[i], &rooms) and rooms;
+        else if (arg == "--mix")
+            ok = ok and extract_mix(argv[i], &mix);
+        else if (arg == "--backend")
+        {
+            std::string b = ok ? argv[i] : "";
+            if (b == "epoll")
+                backend = net::Backend::EPOLL;
+            else if (b == "uring")
+                backend = net::Backend::URING;
+            else
+                ok = false;
+        }
+        else
+        {
+            std::cerr << "Error: unknown argument: " << arg << '\n';
+            return 1;
+        }
+        if (not ok)
+        {
+            std::cerr << "Error: bad or missing value for " << arg << '\n';
+            return 1;
+        }
+    }
+    if (not port and unix_path.empty())
+    {
+        std::cerr << "Error: --port or --unix not specified, try --help\n";
+        return 1;
+    }
+    if (not rooms)
+        rooms = (connections + 7) / 8;
+
+    // A peer that goes away is noticed by write() failing with EPIPE,
+    // rather than by the whole process being killed.
+    signal(SIGPIPE, SIG_IGN);
+
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 and files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    net::ReactorGroup reactors(threads, backend);
+    std::vector<Results> results(reactors.size());
+    // Nothing is polled until everything is connected, so that the
+    // first round trips don't count the connecting.
+    deadline = Clock::now() + std::chrono::hours(1);
+    for (unsigned i = 0; i < connections; ++i)
+    {
+        int fd = unix_path.empty() ? connect_tcp(port, i) : connect_unix(unix_path);
+        if (fd == -1 or fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+        {
+            std::cerr << "Error: connection " << i << " failed: "
+                << strerror(errno) << '\n';
+            return 1;
+        }
+        size_t r = i % reactors.size();
+        auto client = make_unique<BenchClient>(i, &results[r]);
+        std::string hello = client->hello();
+        auto bh = make_unique<net::BufferHandler>(
+                make_unique<net::SentinelParser>(std::move(client)),
+                fd, const_string(hello.data(), hello.size()));
+        // a connection that stops answering shouldn't hang everything
+        bh->set_idle_timeout(std::chrono::seconds(5));
+        if (not reactors[r].add(std::move(bh)))
+            return 1;
+    }
+
+    Clock::time_point start = Clock::now();
+    deadline = start + std::chrono::seconds(seconds);
+    reactors.run();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Results all;
+    for (Results& r : results)
+    {
+        all.latencies.insert(all.latencies.end(),
+                r.latencies.begin(), r.latencies.end());
+        all.commands += r.commands;
+        all.lost += r.lost;
+    }
+    std::sort(all.latencies.begin(), all.latencies.end());
+    auto pct = [&all](double q) -> uint64_t
+    {
+        if (all.latencies.empty())
+            return 0;
+        size_t k = q * all.latencies.size();
+        return all.latencies[std::min(k, all.latencies.size() - 1)];
+    };
+    std::cout << "connections " << connections
+        << ", threads " << threads
+        << ", rooms " << rooms
+        << ", " << elapsed << " s\n";
+    std::cout << "commands " << all.commands
+        << " (" << uint64_t(all.commands / elapsed) << "/s)"
+        << ", round trips " << all.latencies.size()
+        << " (" << uint64_t(all.latencies.size() / elapsed) << "/s)"
+        << ", lost connections " << all.lost << '\n';
+    std::cout << "latency us: p50 " << pct(0.5)
+        << " p99 " << pct(0.99)
+        << " p999 " << pct(0.999)
+        << " max " << (all.latencies.empty() ? 0 : all.latencies.back())
+        << '\n';
+    return all.lost ? 2 : 0;
+}
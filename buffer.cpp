@@ -0,0 +1,225 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "buffer.hpp"
+
+#include <cassert>
+#include <cstring>
+
+namespace net
+{
+
+constexpr size_t MIN_CAPACITY = 256;
+
+RingBuffer::RingBuffer()
+: data()
+, capacity()
+, head()
+, count()
+{}
+
+RingBuffer::RingBuffer(const_array<uint8_t> b)
+: RingBuffer()
+{
+    append(b);
+}
+
+// Move everything to a new allocation, starting at index 0.
+void RingBuffer::reallocate(size_t cap)
+{
+    std::unique_ptr<uint8_t[]> d(new uint8_t[cap]);
+    if (count)
+    {
+        const_array<uint8_t> first = front();
+        memcpy(d.get(), first.data(), first.size());
+        memcpy(d.get() + first.size(), data.get(), count - first.size());
+    }
+    data = std::move(d);
+    capacity = cap;
+    head = 0;
+}
+
+void RingBuffer::grow(size_t n)
+{
+    if (count + n <= capacity)
+        return;
+    size_t cap = capacity ? capacity : MIN_CAPACITY;
+    while (cap < count + n)
+        cap *= 2;
+    reallocate(cap);
+}
+
+void RingBuffer::append(const_array<uint8_t> b)
+{
+    size_t n = b.size();
+    if (not n)
+        return;
+    grow(n);
+    size_t tail = (head + count) & (capacity - 1);
+    size_t room = capacity - tail;
+    if (n <= room)
+        memcpy(data.get() + tail, b.data(), n);
+    else
+    {
+        memcpy(data.get() + tail, b.data(), room);
+        memcpy(data.get(), b.data() + room, n - room);
+    }
+    count += n;
+}
+
+void RingBuffer::consume(size_t n)
+{
+    assert(n <= count);
+    count -= n;
+    // so that the next append is less likely to wrap
+    if (not count)
+        head = 0;
+    else
+        head = (head + n) & (capacity - 1);
+}
+
+void RingBuffer::clear()
+{
+    consume(count);
+}
+
+void RingBuffer::shrink(size_t cap)
+{
+    if (count or capacity <= cap)
+        return;
+    data.reset();
+    capacity = 0;
+}
+
+size_t RingBuffer::reserve(size_t n, iovec iov[2])
+{
+    grow(n);
+    size_t tail = (head + count) & (capacity - 1);
+    size_t first = capacity - tail;
+    if (first > n)
+        first = n;
+    iov[0].iov_base = data.get() + tail;
+    iov[0].iov_len = first;
+    if (first == n)
+        return 1;
+    iov[1].iov_base = data.get();
+    iov[1].iov_len = n - first;
+    return 2;
+}
+
+void RingBuffer::commit(size_t n)
+{
+    assert(count + n <= capacity);
+    count += n;
+}
+
+const_array<uint8_t> RingBuffer::front() const
+{
+    size_t n = capacity - head;
+    if (n > count)
+        n = count;
+    return const_array<uint8_t>(data.get() + head, n);
+}
+
+const_array<uint8_t> RingBuffer::contiguous()
+{
+    if (head + count > capacity)
+        reallocate(capacity);
+    return front();
+}
+
+const_array<uint8_t> OutputQueue::Piece::bytes() const
+{
+    const std::string& s = shared ? *shared : own;
+    return const_array<uint8_t>(
+            reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+OutputQueue::OutputQueue()
+: pieces()
+, offset()
+, count()
+{}
+
+OutputQueue::OutputQueue(const_array<uint8_t> b)
+: OutputQueue()
+{
+    append(b);
+}
+
+void OutputQueue::append(const_array<uint8_t> b)
+{
+    if (not b.size())
+        return;
+    // Not onto the front piece once it is partly written, since what
+    // was written stays allocated until the whole piece is, and would
+    // grow with it.
+    if (pieces.empty() or pieces.back().shared
+            or (pieces.size() == 1 and offset))
+        pieces.emplace_back();
+    pieces.back().own.append(
+            reinterpret_cast<const char *>(b.data()), b.size());
+    count += b.size();
+}
+
+void OutputQueue::append(Segment s)
+{
+    if (not s or s->empty())
+        return;
+    count += s->size();
+    pieces.emplace_back();
+    pieces.back().shared = std::move(s);
+}
+
+void OutputQueue::consume(size_t n)
+{
+    assert(n <= count);
+    count -= n;
+    n += offset;
+    while (not pieces.empty())
+    {
+        size_t z = pieces.front().bytes().size();
+        if (n < z)
+            break;
+        n -= z;
+        pieces.pop_front();
+    }
+    offset = n;
+}
+
+void OutputQueue::clear()
+{
+    pieces.clear();
+    offset = 0;
+    count = 0;
+}
+
+size_t OutputQueue::gather(iovec *iov, size_t n) const
+{
+    size_t i = 0;
+    size_t skip = offset;
+    for (const Piece& p : pieces)
+    {
+        if (i == n)
+            break;
+        const_array<uint8_t> b = p.bytes();
+        iov[i].iov_base = const_cast<uint8_t *>(b.data() + skip);
+        iov[i].iov_len = b.size() - skip;
+        skip = 0;
+        ++i;
+    }
+    return i;
+}
+
+void OutputQueue::copy_to(std::string *out) const
+{
+    out->reserve(out->size() + count);
+    size_t skip = offset;
+    for (const Piece& p : pieces)
+    {
+        const_array<uint8_t> b = p.bytes();
+        out->append(b.begin() + skip, b.end());
+        skip = 0;
+    }
+}
+
+} // namespace net
@@ -0,0 +1,108 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "const_array.hpp"
+
+namespace net
+{
+
+// A growable FIFO of bytes, for the input of a connection.
+// Bytes are consumed from the front by advancing an index instead of
+// moving everything that is left, so draining it costs linear time.
+class RingBuffer
+{
+    std::unique_ptr<uint8_t[]> data;
+    // zero, or a power of 2
+    size_t capacity;
+    size_t head;
+    size_t count;
+
+    void reallocate(size_t cap);
+    void grow(size_t n);
+public:
+    RingBuffer();
+    RingBuffer(const_array<uint8_t> b);
+    RingBuffer(RingBuffer&&) = default;
+    RingBuffer& operator = (RingBuffer&&) = default;
+
+    bool empty() const { return not count; }
+    size_t size() const { return count; }
+
+    void append(const_array<uint8_t> b);
+    void consume(size_t n);
+    void clear();
+    // Release the memory if it is empty and bigger than cap.
+    void shrink(size_t cap);
+    // Make room for n more bytes, and point iov at that space
+    // (split in 2 where it wraps around), for reading into.
+    // Returns how many iovecs were filled.
+    size_t reserve(size_t n, iovec iov[2]);
+    // Add n bytes that were read into the space from reserve().
+    void commit(size_t n);
+    // The leading bytes that are contiguous in memory,
+    // which is all of them unless they wrap around.
+    const_array<uint8_t> front() const;
+    // All the bytes, which have to be moved if they wrap around.
+    // That happens at most once per lap, so it is amortized.
+    const_array<uint8_t> contiguous();
+};
+
+// Immutable bytes, which can be queued on any number of connections
+// without copying. Render a broadcast into one of these once.
+typedef std::shared_ptr<const std::string> Segment;
+
+// The output of a connection, as a queue of pieces to be sent with
+// writev(). Shared segments are referenced; other writes are copied,
+// and consecutive copies are coalesced into one piece.
+//
+// Pieces don't move once queued, so the iovecs from gather() are
+// valid until the bytes are consumed (even if the queue is moved),
+// as long as nothing more is appended.
+class OutputQueue
+{
+    struct Piece
+    {
+        // either shared, or ours
+        Segment shared;
+        std::string own;
+
+        const_array<uint8_t> bytes() const;
+    };
+
+    std::deque<Piece> pieces;
+    // into the first piece
+    size_t offset;
+    size_t count;
+public:
+    OutputQueue();
+    OutputQueue(const_array<uint8_t> b);
+    OutputQueue(OutputQueue&&) = default;
+    OutputQueue& operator = (OutputQueue&&) = default;
+
+    bool empty() const { return not count; }
+    size_t size() const { return count; }
+
+    void append(const_array<uint8_t> b);
+    void append(Segment s);
+    void consume(size_t n);
+    void clear();
+    // Point up to n iovecs at the front of the queue.
+    // Returns how many were filled.
+    size_t gather(iovec *iov, size_t n) const;
+    // Append a copy of all the bytes, e.g. to pass them on.
+    void copy_to(std::string *out) const;
+};
+
+} // namespace net
+
+#endif // BUFFER_HPP
@@ -1,8 +1,10 @@
 // Copyright 2012 Ben Longbons
 // GPL3+
 #include "chat.hpp"
+#include "federation.hpp"
 
-#include <map>
+#include <algorithm>
+#include <atomic>
 
 namespace chat
 {
@@ -26,74 +28,280 @@ const_string colors[] =
 };
 
 static
-size_t color_index = 0;
+std::atomic<size_t> color_index(0);
+
+Federation *federation = nullptr;
 
 Connection::Connection(
         std::shared_ptr<Room> r,
         net::BufferHandler *b)
-: room(r), out(b), color(colors[color_index++])
+: room(r), out(b), home(net::SocketSet::current())
+, color(colors[color_index++ % 6])
 {
-    if (color_index == 6)
-        color_index = 0;
-    room->chatters.insert(this);
+    std::lock_guard<std::mutex> guard(room->lock);
+    room->chatters[home].insert(this);
 }
 
 Connection::~Connection()
 {
-    room->chatters.erase(this);
+    std::lock_guard<std::mutex> guard(room->lock);
+    auto it = room->chatters.find(home);
+    it->second.erase(this);
+    if (it->second.empty())
+        room->chatters.erase(it);
 }
 
 void Connection::say(const_string nick, const_string msg)
 {
     const_string colon = ": ";
     const_string eol = "\e[m\r\n";
-    for (Connection *c : room->chatters)
+    // Rendered once, and shared by every recipient's output queue.
+    auto text = std::make_shared<std::string>();
+    text->reserve(color.size() + nick.size() + colon.size()
+            + msg.size() + eol.size());
+    for (const_string part : {color, nick, colon, msg, eol})
+        text->append(part.data(), part.size());
+    net::Segment line = std::move(text);
+
+    room->broadcast(home, line);
+    if (federation)
+        federation->said(room->name, line);
+}
+
+void Room::broadcast(net::SocketSet *here, net::Segment line)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    ++lines;
+    for (auto& pair : chatters)
+    {
+        net::SocketSet *set = pair.first;
+        if (set == here)
+        {
+            for (Connection *c : pair.second)
+                c->out->write(line);
+            bytes += line->size() * pair.second.size();
+            continue;
+        }
+        std::shared_ptr<Room> r = shared_from_this();
+        set->post([r, set, line]() { r->deliver(set, line); });
+    }
+}
+
+static
+std::mutex nicks_lock;
+static
+Interner nick_names;
+// by the id of the nick: whether it is taken here, and by how many
+// other nodes, each of which holds the name in nick_names
+static
+std::vector<bool> nicks;
+static
+std::vector<uint32_t> remote_nicks;
+// Also by id, for a nick taken here: who has it, on which thread, and
+// which taking of it this is (numbered, so that a late nick_lost()
+// can't reach whoever took it next).
+struct Holder
+{
+    NickHolder *holder;
+    net::SocketSet *home;
+    uint64_t serial;
+};
+static
+std::vector<Holder> holders;
+static
+uint64_t last_serial;
+
+static
+Interner::Id intern_nick(const_string nick)
+{
+    Interner::Id id = nick_names.intern(nick);
+    if (id >= nicks.size())
     {
-        c->out->write(color);
-        c->out->write(nick);
-        c->out->write(colon);
-        c->out->write(msg);
-        c->out->write(eol);
+        nicks.resize(id + 1);
+        remote_nicks.resize(id + 1);
+        holders.resize(id + 1);
     }
+    return id;
 }
 
-bool set_nick(const_string oldname, const_string name)
+static
+void release_nick(Interner::Id id)
 {
-    static
-    std::set<std::string> nicks;
+    if (id == Interner::NONE or not nicks[id])
+        return;
+    nicks[id] = false;
+    holders[id] = Holder();
+    // while the name is still there
+    if (federation)
+        federation->released(nick_names.name(id));
+    nick_names.release(id);
+}
 
+// The federation is told while the lock is held,
+// so that it passes them on in the same order.
+bool set_nick(const_string oldname, const_string name, NickHolder *holder)
+{
+    std::lock_guard<std::mutex> guard(nicks_lock);
+    Interner::Id old = nick_names.find(oldname);
     if (not name)
     {
-        nicks.erase(std::string(oldname.begin(), oldname.end()));
+        release_nick(old);
         return false;
     }
-    std::string nick(name.begin(), name.end());
-    if (not nicks.insert(nick).second)
+    Interner::Id nick = intern_nick(name);
+    if (remote_nicks[nick] or nicks[nick])
+    {
+        nick_names.release(nick);
         return false;
-    nicks.erase(std::string(oldname.begin(), oldname.end()));
+    }
+    nicks[nick] = true;
+    holders[nick] = {holder, net::SocketSet::current(), ++last_serial};
+    if (federation)
+        federation->claimed(nick_names.name(nick));
+    release_nick(old);
     return true;
 }
 
+std::vector<std::string> local_nicks()
+{
+    std::vector<std::string> out;
+    {
+        std::lock_guard<std::mutex> guard(nicks_lock);
+        for (Interner::Id id = 0; id < nicks.size(); ++id)
+            if (nicks[id])
+                out.push_back(nick_names.name(id));
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+// On the holder's thread, where it can't go away meanwhile.
 static
-std::map<std::string, std::weak_ptr<Room>> rooms;
+void lose_nick(Interner::Id id, uint64_t serial)
+{
+    NickHolder *holder;
+    {
+        std::lock_guard<std::mutex> guard(nicks_lock);
+        if (id >= nicks.size() or not nicks[id] or holders[id].serial != serial)
+            return;
+        holder = holders[id].holder;
+    }
+    holder->nick_lost();
+}
+
+void hold_remote_nick(const std::string& nick, bool prevails)
+{
+    std::lock_guard<std::mutex> guard(nicks_lock);
+    Interner::Id id = intern_nick(const_string(nick));
+    ++remote_nicks[id];
+    if (not prevails or not nicks[id] or not holders[id].holder)
+        return;
+    uint64_t serial = holders[id].serial;
+    holders[id].home->post([id, serial]() { lose_nick(id, serial); });
+}
+
+void free_remote_nick(const std::string& nick)
+{
+    std::lock_guard<std::mutex> guard(nicks_lock);
+    Interner::Id id = nick_names.find(const_string(nick));
+    if (id != Interner::NONE and remote_nicks[id])
+    {
+        --remote_nicks[id];
+        nick_names.release(id);
+    }
+}
+
+// Called on set's own thread.
+void Room::deliver(net::SocketSet *set, net::Segment line)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = chatters.find(set);
+    if (it == chatters.end())
+        return;
+    for (Connection *c : it->second)
+        c->out->write(line);
+    bytes += line->size() * it->second.size();
+}
 
-Room::Room(std::string name, privacy_hack)
-: name(name)
+static
+std::mutex rooms_lock;
+static
+Interner room_names;
+// by the id of the name
+static
+std::vector<std::weak_ptr<Room>> rooms;
+
+void Room::relay(const_string room, net::Segment line)
+{
+    std::shared_ptr<Room> r;
+    {
+        std::lock_guard<std::mutex> guard(rooms_lock);
+        Interner::Id id = room_names.find(room);
+        if (id != Interner::NONE)
+            r = rooms[id].lock();
+    }
+    if (r)
+        r->broadcast(net::SocketSet::current(), line);
+}
+
+std::vector<RoomStats> Room::stats()
+{
+    // Not looked at under rooms_lock, since letting go of the last
+    // reference to one would take it again.
+    std::vector<std::shared_ptr<Room>> all;
+    {
+        std::lock_guard<std::mutex> guard(rooms_lock);
+        for (auto& w : rooms)
+            if (auto r = w.lock())
+                all.push_back(std::move(r));
+    }
+    std::vector<RoomStats> out;
+    for (auto& r : all)
+    {
+        std::lock_guard<std::mutex> guard(r->lock);
+        RoomStats s {r->name, 0, r->lines, r->bytes};
+        for (auto& set : r->chatters)
+            s.chatters += set.second.size();
+        out.push_back(std::move(s));
+    }
+    return out;
+}
+
+Room::Room(Interner::Id i, const std::string& n, privacy_hack)
+: id(i)
+, name(n)
+, lock()
+, chatters()
+, lines()
+, bytes()
 {}
 
 Room::~Room()
 {
-    rooms.erase(name);
+    std::lock_guard<std::mutex> guard(rooms_lock);
+    // Another thread may already have replaced us. If not, let go of
+    // the block that make_shared() put us in.
+    if (rooms[id].expired())
+        rooms[id].reset();
+    room_names.release(id);
 }
 
+// Each room holds its name, so the name (and its id) is only free
+// once every room by that name is gone.
 std::shared_ptr<Room> Room::get(const_string room)
 {
-    std::string s(room.begin(), room.end());
-    auto it = rooms.find(s);
-    if (it != rooms.end())
-        return it->second.lock();
-    auto n = std::make_shared<Room>(s, privacy_ok);
-    rooms.insert({s, n});
+    std::lock_guard<std::mutex> guard(rooms_lock);
+    Interner::Id id = room_names.intern(room);
+    if (id >= rooms.size())
+        rooms.resize(id + 1);
+    // may have expired, but its destructor is still waiting for the lock
+    if (auto r = rooms[id].lock())
+    {
+        room_names.release(id);
+        return r;
+    }
+    auto n = std::make_shared<Room>(id, room_names.name(id), privacy_ok);
+    rooms[id] = n;
     return n;
 }
 
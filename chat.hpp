@@ -3,10 +3,15 @@
 // Copyright 2012 Ben Longbons
 // GPL3+
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "const_array.hpp"
+#include "intern.hpp"
 #include "net.hpp"
 
 namespace chat
@@ -26,6 +31,8 @@ class Connection
 
     std::shared_ptr<Room> room;
     net::BufferHandler *out;
+    // the reactor that out belongs to
+    net::SocketSet *home;
     const_string color;
 
     Connection(const Connection&) = delete;
@@ -35,21 +42,80 @@ public:
     void say(const_string name, const_string msg);
 };
 
-bool set_nick(const_string oldnick, const_string nick);
+// Whoever takes a nick here, so that it can be made to give it up.
+class NickHolder
+{
+public:
+    // The nick was also taken on another node at about the same time,
+    // and the other node gets it (see hold_remote_nick()). Called on
+    // the thread that took it, which must set_nick() to something else.
+    virtual void nick_lost() = 0;
+protected:
+    ~NickHolder() = default;
+};
 
-class Room
+// Called on the holder's own thread, if there is one.
+bool set_nick(const_string oldnick, const_string nick, NickHolder *holder=nullptr);
+// The nicks taken on this node.
+std::vector<std::string> local_nicks();
+// Nicks taken on other nodes, which can't be taken here. A nick may be
+// held more than once (by different nodes), and is free once all of
+// them let go.
+//
+// Two nodes can let the same nick be taken before either hears about
+// it from the other. Each then hears that the other has it too, and
+// both agree which one prevails (e.g. by comparing their names), so
+// that the other one tells its holder it has lost the nick. Until the
+// holder takes another, both have it.
+void hold_remote_nick(const std::string& nick, bool prevails);
+void free_remote_nick(const std::string& nick);
+
+// What a room has been used for, since it was made.
+struct RoomStats
+{
+    std::string name;
+    size_t chatters;
+    // lines said (here, or relayed from other nodes)
+    uint64_t lines;
+    // what was written to chatters, i.e. each line times its audience
+    uint64_t bytes;
+};
+
+class Federation;
+// If set (once, before anything connects), what happens here is also
+// passed on to other nodes through it.
+extern Federation *federation;
+
+class Room : public std::enable_shared_from_this<Room>
 {
     friend class Connection;
 
-    std::string name;
-    std::set<Connection *> chatters;
+    const Interner::Id id;
+    const std::string& name;
+    // Connections are grouped by the reactor they belong to, and are
+    // only ever written to from that reactor's thread.
+    // Other threads only look at the structure, under the lock.
+    std::mutex lock;
+    std::map<net::SocketSet *, std::set<Connection *>> chatters;
+    // also under the lock
+    uint64_t lines;
+    uint64_t bytes;
+
+    // To every chatter, from the thread of here.
+    void broadcast(net::SocketSet *here, net::Segment line);
+    void deliver(net::SocketSet *set, net::Segment line);
 
     enum privacy_hack {privacy_ok};
 public:
     // really private
-    Room(std::string name, privacy_hack);
+    Room(Interner::Id id, const std::string& name, privacy_hack);
 
     static std::shared_ptr<Room> get(const_string name);
+    // A line that was said on another node, for the chatters here
+    // (if there are any).
+    static void relay(const_string name, net::Segment line);
+    // Every room there is, by name.
+    static std::vector<RoomStats> stats();
     ~Room();
 };
 
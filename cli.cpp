@@ -51,28 +51,4 @@ namespace cli
             s = s.head(s.size() - 1);
         return s;
     }
-
-    void Shell::add_command(std::string name, std::string help, Command f)
-    {
-        this->_commands[name] = std::move(f);
-        this->_helps[std::move(name)] = std::move(help);
-    }
-
-    Status Shell::operator()(const_string line)
-    {
-        auto pair = split_first(line);
-        if (pair.first.data() == nullptr)
-            return Status::EMPTY;
-        auto cmd = pair.first;
-        auto args = pair.second;
-        auto it = _commands.find(std::string(cmd.begin(), cmd.end()));
-        if (it == _commands.end())
-        {
-            if (_default)
-                return _default(line);
-            return Status::NOT_FOUND;
-        }
-        return it->second(line);
-
-    }
 }
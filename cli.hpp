@@ -3,8 +3,8 @@
 // Copyright 2012 Ben Longbons
 // GPL3+
 
-#include <functional>
-#include <map>
+#include <string>
+#include <vector>
 
 #include "const_array.hpp"
 
@@ -69,24 +69,41 @@ enum class Status
     ERROR,
 };
 
-// A single command.
-// The argument is fused selfname-arguments, though obviously
-// the selfname was extracted at some point in the past.
-// use cli::extract to split the args.
-typedef std::function<Status(const_string)> Command;
-
-// A set of commands and an environment
-//
-class Shell
+// The commands that a type of shell understands, which are built once
+// and shared by every shell of that type.
+template<class T>
+class CommandTable
 {
-protected:
-    std::map<std::string, Command> _commands;
-    std::map<std::string, std::string> _helps;
-    Command _default;
+public:
+    // A single command.
+    // The argument is fused selfname-arguments, though obviously
+    // the selfname was extracted at some point in the past.
+    // use cli::extract to split the args.
+    typedef Status (T::*Command)(const_string);
+private:
+    struct Entry
+    {
+        std::string name;
+        // empty for secret commands
+        std::string help;
+        Command f;
+    };
+    // sorted by name, so that lookup doesn't need a std::string
+    std::vector<Entry> entries;
+    // for lines that aren't any command
+    Command fallback;
 
-    void add_command(std::string name, std::string help, Command f);
+    const Entry *find(const_string name) const;
 public:
-    Status operator()(const_string line);
+    CommandTable(Command f=nullptr);
+    // If help is empty, the command is not listed.
+    void add(std::string name, std::string help, Command f);
+    Status operator()(T *shell, const_string line) const;
+    // nullptr if there is no such command, or it is secret
+    const std::string *help(const_string name) const;
+    // Call f with the name of every listed command, in order.
+    template<class F>
+    void each_name(F f) const;
 };
 
 // This is ADL-lookup'ed. There are a couple of implementations not shown.
@@ -1,5 +1,7 @@
 // Copyright 2012 Ben Longbons
 // GPL3+
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 
 namespace cli
@@ -47,4 +49,78 @@ bool extract(const_string line, P *... p)
     return do_extract(line, p...);
 }
 
+inline
+bool name_less(const std::string& a, const_string b)
+{
+    size_t n = std::min(a.size(), b.size());
+    int c = memcmp(a.data(), b.data(), n);
+    return c ? c < 0 : a.size() < b.size();
+}
+
+template<class T>
+CommandTable<T>::CommandTable(Command f)
+: entries()
+, fallback(f)
+{}
+
+template<class T>
+const typename CommandTable<T>::Entry *CommandTable<T>::find(const_string name) const
+{
+    auto it = std::lower_bound(entries.begin(), entries.end(), name,
+            [](const Entry& e, const_string n) { return name_less(e.name, n); });
+    if (it == entries.end() or it->name.size() != name.size()
+            or memcmp(it->name.data(), name.data(), name.size()))
+        return nullptr;
+    return &*it;
+}
+
+template<class T>
+void CommandTable<T>::add(std::string name, std::string help, Command f)
+{
+    const_string n(name.data(), name.size());
+    auto it = std::lower_bound(entries.begin(), entries.end(), n,
+            [](const Entry& e, const_string n) { return name_less(e.name, n); });
+    if (it != entries.end() and it->name == name)
+    {
+        it->help = std::move(help);
+        it->f = f;
+        return;
+    }
+    entries.insert(it, Entry{std::move(name), std::move(help), f});
+}
+
+template<class T>
+Status CommandTable<T>::operator()(T *shell, const_string line) const
+{
+    auto pair = split_first(line);
+    if (pair.first.data() == nullptr)
+        return Status::EMPTY;
+    const Entry *e = find(pair.first);
+    if (not e)
+    {
+        if (fallback)
+            return (shell->*fallback)(line);
+        return Status::NOT_FOUND;
+    }
+    return (shell->*(e->f))(line);
+}
+
+template<class T>
+const std::string *CommandTable<T>::help(const_string name) const
+{
+    const Entry *e = find(name);
+    if (not e or e->help.empty())
+        return nullptr;
+    return &e->help;
+}
+
+template<class T>
+template<class F>
+void CommandTable<T>::each_name(F f) const
+{
+    for (const Entry& e : entries)
+        if (not e.help.empty())
+            f(e.name);
+}
+
 } // namespace cli
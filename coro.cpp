@@ -0,0 +1,181 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "coro.hpp"
+
+#include <cstring>
+#include <new>
+
+namespace net
+{
+
+FramePool::~FramePool()
+{
+    for (auto& pair : free)
+        while (Block *b = pair.second)
+        {
+            pair.second = b->next;
+            ::operator delete(reinterpret_cast<Header *>(b) - 1);
+        }
+}
+
+void *FramePool::allocate(FramePool *pool, size_t z)
+{
+    Header *h = nullptr;
+    if (pool)
+        for (auto& pair : pool->free)
+            if (pair.first == z and pair.second)
+            {
+                Block *b = pair.second;
+                pair.second = b->next;
+                h = reinterpret_cast<Header *>(b) - 1;
+                break;
+            }
+    if (not h)
+        h = static_cast<Header *>(::operator new(sizeof(Header) + std::max(z, sizeof(Block))));
+    h->pool = pool;
+    h->size = z;
+    return h + 1;
+}
+
+void FramePool::deallocate(void *p)
+{
+    Header *h = static_cast<Header *>(p) - 1;
+    FramePool *pool = h->pool;
+    if (not pool)
+    {
+        ::operator delete(h);
+        return;
+    }
+    Block *b = static_cast<Block *>(p);
+    for (auto& pair : pool->free)
+        if (pair.first == h->size)
+        {
+            b->next = pair.second;
+            pair.second = b;
+            return;
+        }
+    b->next = nullptr;
+    pool->free.push_back({h->size, b});
+}
+
+std::coroutine_handle<> PromiseBase::finish() noexcept
+{
+    if (continuation)
+        return continuation;
+    // the Stream's own is done, and so is the connection
+    if (root_of)
+        root_of->wbh->hang_up();
+    return std::noop_coroutine();
+}
+
+Stream::Stream(Start s)
+: pool()
+, start(s)
+, root()
+, wbh()
+, waiting()
+, want(Want::NOTHING)
+, want_size()
+, input(nullptr)
+, taken()
+, no_newline()
+, result(nullptr)
+{}
+
+// The frames are destroyed before the pool they came from.
+Stream::~Stream()
+{
+    root = Task<>();
+}
+
+void Stream::init(BufferHandler *wbh)
+{
+    this->wbh = wbh;
+    root = start(*this);
+    root.h.promise().root_of = this;
+    // up to the first thing it has to wait for
+    root.h.resume();
+}
+
+bool Stream::take()
+{
+    size_t left = input.size() - taken;
+    const uint8_t *p = input.data() + taken;
+    switch (want)
+    {
+    case Want::LINE:
+    {
+        if (left <= no_newline)
+            return false;
+        const void *nl = memchr(p + no_newline, '\n', left - no_newline);
+        if (not nl)
+        {
+            no_newline = left;
+            return false;
+        }
+        size_t n = static_cast<const uint8_t *>(nl) - p;
+        result = Bytes(p, n and p[n - 1] == '\r' ? n - 1 : n);
+        taken += n + 1;
+        break;
+    }
+    case Want::EXACT:
+        if (left < want_size)
+            return false;
+        result = Bytes(p, want_size);
+        taken += want_size;
+        break;
+    default:
+        return false;
+    }
+    want = Want::NOTHING;
+    no_newline = 0;
+    return true;
+}
+
+Stream::LineAwaiter Stream::read_line()
+{
+    want = Want::LINE;
+    return LineAwaiter(this);
+}
+
+Stream::ReadAwaiter Stream::read_exact(size_t n)
+{
+    want = Want::EXACT;
+    want_size = n;
+    return ReadAwaiter(this);
+}
+
+Stream::WriteAwaiter Stream::write(const_array<uint8_t> b)
+{
+    wbh->write(b);
+    return WriteAwaiter(this);
+}
+
+Stream::WriteAwaiter Stream::write(Segment s)
+{
+    wbh->write(std::move(s));
+    return WriteAwaiter(this);
+}
+
+size_t Stream::parse(Bytes bytes)
+{
+    // This may be the same input again, with more after it.
+    input = bytes;
+    taken = 0;
+    // Run the coroutine for as long as what it waits for is here.
+    while (waiting and take())
+        std::exchange(waiting, nullptr).resume();
+    // and no input at all outside of parse()
+    input = nullptr;
+    return std::exchange(taken, 0);
+}
+
+void Stream::drained()
+{
+    if (want != Want::DRAIN)
+        return;
+    want = Want::NOTHING;
+    std::exchange(waiting, nullptr).resume();
+}
+
+} // namespace net
@@ -0,0 +1,308 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+//
+// Protocols written as coroutines, instead of a LineHandler that is
+// given one line at a time, and has to remember where it was:
+//
+//  net::Task<> login(net::Stream& s)
+//  {
+//      co_await s.write("name? ");
+//      std::string name = co_await s.read_line();
+//      ...
+//  }
+//  ... make_unique<net::BufferHandler>(make_unique<net::Stream>(login), fd)
+//
+// Everything happens on the thread of the connection, and a coroutine
+// waiting for input is resumed directly from parsing it.
+
+#include <coroutine>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "net.hpp"
+
+namespace net
+{
+
+// The frames of the coroutines of one connection, kept for reuse by
+// size, so that a protocol calling the same helpers over and over
+// only allocates the first time.
+class FramePool
+{
+    struct Block
+    {
+        Block *next;
+    };
+    // in front of each frame, to find its way back
+    struct alignas(alignof(std::max_align_t)) Header
+    {
+        FramePool *pool;
+        size_t size;
+    };
+    // a protocol only has a few sizes of frame
+    std::vector<std::pair<size_t, Block *>> free;
+
+    FramePool(const FramePool&) = delete;
+public:
+    FramePool() = default;
+    ~FramePool();
+    // From the global heap if pool is null.
+    static void *allocate(FramePool *pool, size_t z);
+    static void deallocate(void *p);
+};
+
+class Stream;
+
+// The pool of the first of the arguments that is a Stream, if any.
+inline
+FramePool *find_pool();
+template<class F, class... A>
+FramePool *find_pool(F& first, A&... rest);
+
+// The promise of every Task, whatever it returns.
+class PromiseBase
+{
+    template<class T>
+    friend class Task;
+    friend class Stream;
+
+    // who co_awaited this one, or nothing for the Stream's own
+    std::coroutine_handle<> continuation;
+    Stream *root_of;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().finish();
+        }
+        void await_resume() noexcept {}
+    };
+    std::coroutine_handle<> finish() noexcept;
+public:
+    PromiseBase()
+    : continuation()
+    , root_of()
+    {}
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    // to whoever resumed it, as from any other callback
+    void unhandled_exception() { throw; }
+
+    // The frame comes from the pool of whichever argument is a Stream.
+    template<class... A>
+    static void *operator new(size_t z, A&... args)
+    {
+        return FramePool::allocate(find_pool(args...), z);
+    }
+    static void operator delete(void *p)
+    {
+        FramePool::deallocate(p);
+    }
+};
+
+// A coroutine of a protocol. It starts when it is co_awaited (or, for
+// the one given to a Stream, when the connection is made), and is
+// destroyed along with the Task - which, for a connection that goes
+// away, may be while it is still waiting.
+template<class T=void>
+class Task
+{
+public:
+    class promise_type : public PromiseBase
+    {
+        friend class Task;
+        T value;
+    public:
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_value(T v) { value = std::move(v); }
+    };
+private:
+    std::coroutine_handle<promise_type> h;
+
+    explicit
+    Task(std::coroutine_handle<promise_type> c)
+    : h(c)
+    {}
+public:
+    Task() : h() {}
+    Task(Task&& o) : h(std::exchange(o.h, nullptr)) {}
+    Task& operator = (Task&& o)
+    {
+        std::swap(h, o.h);
+        return *this;
+    }
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+    {
+        h.promise().continuation = caller;
+        return h;
+    }
+    T await_resume() { return std::move(h.promise().value); }
+};
+
+template<>
+class Task<void>
+{
+    friend class Stream;
+public:
+    class promise_type : public PromiseBase
+    {
+    public:
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_void() {}
+    };
+private:
+    std::coroutine_handle<promise_type> h;
+
+    explicit
+    Task(std::coroutine_handle<promise_type> c)
+    : h(c)
+    {}
+public:
+    Task() : h() {}
+    Task(Task&& o) : h(std::exchange(o.h, nullptr)) {}
+    Task& operator = (Task&& o)
+    {
+        std::swap(h, o.h);
+        return *this;
+    }
+    ~Task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+    {
+        h.promise().continuation = caller;
+        return h;
+    }
+    void await_resume() {}
+};
+
+// A Parser that runs a coroutine, which co_awaits its input instead
+// of being handed it. When the coroutine returns, the connection is
+// closed once its output is flushed (and any input after it is read).
+class Stream : public Parser
+{
+    friend class PromiseBase;
+    template<class F, class... A>
+    friend FramePool *find_pool(F&, A&...);
+public:
+    typedef std::function<Task<>(Stream&)> Start;
+private:
+    enum class Want
+    {
+        NOTHING,
+        LINE,
+        EXACT,
+        DRAIN,
+    };
+
+    // must outlive the frames
+    FramePool pool;
+    Start start;
+    Task<> root;
+    BufferHandler *wbh;
+    // the coroutine that is waiting, and what for
+    std::coroutine_handle<> waiting;
+    Want want;
+    size_t want_size;
+    // during parse(): the input, and how much has been taken
+    Bytes input;
+    size_t taken;
+    // how much after taken is known not to end a line
+    size_t no_newline;
+    // what the last read got
+    Bytes result;
+
+    // Try to satisfy want from the input.
+    bool take();
+
+    class ReadAwaiter
+    {
+        Stream *s;
+    public:
+        ReadAwaiter(Stream *st) : s(st) {}
+        bool await_ready() { return s->take(); }
+        void await_suspend(std::coroutine_handle<> h) { s->waiting = h; }
+        Bytes await_resume() { return s->result; }
+    };
+    class LineAwaiter : public ReadAwaiter
+    {
+    public:
+        using ReadAwaiter::ReadAwaiter;
+        const_string await_resume() { return ReadAwaiter::await_resume(); }
+    };
+    class WriteAwaiter
+    {
+        Stream *s;
+    public:
+        WriteAwaiter(Stream *st) : s(st) {}
+        bool await_ready() { return not s->wbh->backed_up(); }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            s->want = Want::DRAIN;
+            s->waiting = h;
+        }
+        void await_resume() {}
+    };
+public:
+    Stream(Start s);
+    ~Stream();
+
+    // The next line, without its '\n' (or "\r\n").
+    // Like every read, it is only valid until the next co_await.
+    LineAwaiter read_line();
+    // The next n bytes.
+    ReadAwaiter read_exact(size_t n);
+    // Queue the bytes, and wait if the output has backed up (see
+    // BufferHandler::set_output_limits()) until it goes down again.
+    WriteAwaiter write(const_array<uint8_t> b);
+    WriteAwaiter write(Segment s);
+
+    virtual void init(BufferHandler *wbh) override;
+    virtual size_t parse(Bytes bytes) override;
+    virtual void drained() override;
+};
+
+inline
+FramePool *find_pool()
+{
+    return nullptr;
+}
+
+template<class F, class... A>
+FramePool *find_pool(F& first, A&... rest)
+{
+    if constexpr (std::is_base_of<Stream, F>::value)
+        return &first.pool;
+    else
+        return find_pool(rest...);
+}
+
+} // namespace net
+
+#endif // CORO_HPP
@@ -0,0 +1,385 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "datagram.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <algorithm>
+#include <functional>
+#include <string_view>
+
+// not in older headers
+#ifndef UDP_SEGMENT
+# define UDP_SEGMENT 103
+#endif
+
+namespace net
+{
+
+// Datagrams per recvmmsg() or sendmmsg().
+constexpr size_t BATCH = 32;
+// recvmmsg() calls per wakeup, before giving other handlers a turn
+// (the socket is level-triggered, so the rest are not forgotten).
+constexpr size_t READS_PER_WAKEUP = 4;
+// What the kernel will split one send into (UDP_MAX_SEGMENTS), and
+// what fits in the biggest UDP datagram over IPv4.
+constexpr size_t MAX_SEGMENTS = 64;
+constexpr size_t MAX_SEGMENTED = 65507;
+// Buckets for rate-limiting sources.
+constexpr size_t SOURCE_BUCKETS = 4096;
+
+static
+int datagram_socket(uint16_t port, IPv4 iface, const DatagramOptions& opts)
+{
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = iface;
+    return bind_socket(SOCK_DGRAM, reinterpret_cast<sockaddr *>(&addr),
+            sizeof(addr), opts);
+}
+
+static
+int datagram_socket(uint16_t port, IPv6 iface, const DatagramOptions& opts)
+{
+    sockaddr_in6 addr {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = iface;
+    return bind_socket(SOCK_DGRAM, reinterpret_cast<sockaddr *>(&addr),
+            sizeof(addr), opts);
+}
+
+// Just what tells peers apart, and not whatever else is in the struct.
+static
+std::string address_key(const sockaddr *addr, socklen_t addr_len)
+{
+    std::string key(1, char(addr->sa_family));
+    if (addr->sa_family == AF_INET and addr_len >= sizeof(sockaddr_in))
+    {
+        auto in = reinterpret_cast<const sockaddr_in *>(addr);
+        key.append(reinterpret_cast<const char *>(&in->sin_port), sizeof(in->sin_port));
+        key.append(reinterpret_cast<const char *>(&in->sin_addr), sizeof(in->sin_addr));
+    }
+    else if (addr->sa_family == AF_INET6 and addr_len >= sizeof(sockaddr_in6))
+    {
+        auto in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+        key.append(reinterpret_cast<const char *>(&in6->sin6_port), sizeof(in6->sin6_port));
+        key.append(reinterpret_cast<const char *>(&in6->sin6_addr), sizeof(in6->sin6_addr));
+        key.append(reinterpret_cast<const char *>(&in6->sin6_scope_id), sizeof(in6->sin6_scope_id));
+    }
+    else
+        key.append(reinterpret_cast<const char *>(addr), addr_len);
+    return key;
+}
+
+DatagramHandler::DatagramHandler(uint16_t port, IPv4 iface, DatagramOptions opts)
+: Handler(datagram_socket(port, iface, opts), true, false,
+        Trigger::LEVEL, Writes::EAGER)
+, max_datagram(opts.max_datagram ? opts.max_datagram : 2048)
+, max_output(opts.max_output)
+, segment(opts.segment)
+, source_rate(opts.source_rate)
+, source_burst(opts.source_burst ? opts.source_burst : opts.source_rate)
+, sources(source_rate ? SOURCE_BUCKETS : 0,
+        Bucket {source_burst * 1000ull, std::chrono::milliseconds::zero()})
+, peers()
+, free_peers()
+, by_address()
+, queue()
+, queued()
+, inbox(new uint8_t[BATCH * max_datagram])
+, peer_timeout()
+, sweep_timer([this]() { this->sweep(); })
+{}
+
+DatagramHandler::DatagramHandler(uint16_t port, IPv6 iface, DatagramOptions opts)
+: Handler(datagram_socket(port, iface, opts), true, false,
+        Trigger::LEVEL, Writes::EAGER)
+, max_datagram(opts.max_datagram ? opts.max_datagram : 2048)
+, max_output(opts.max_output)
+, segment(opts.segment)
+, source_rate(opts.source_rate)
+, source_burst(opts.source_burst ? opts.source_burst : opts.source_rate)
+, sources(source_rate ? SOURCE_BUCKETS : 0,
+        Bucket {source_burst * 1000ull, std::chrono::milliseconds::zero()})
+, peers()
+, free_peers()
+, by_address()
+, queue()
+, queued()
+, inbox(new uint8_t[BATCH * max_datagram])
+, peer_timeout()
+, sweep_timer([this]() { this->sweep(); })
+{}
+
+DatagramHandler::Peer DatagramHandler::peer(const sockaddr *addr, socklen_t addr_len)
+{
+    std::string key = address_key(addr, addr_len);
+    auto it = by_address.find(key);
+    if (it != by_address.end())
+        return it->second;
+    Peer p;
+    if (not free_peers.empty())
+    {
+        p = free_peers.back();
+        free_peers.pop_back();
+    }
+    else
+    {
+        p = peers.size();
+        peers.emplace_back();
+    }
+    PeerInfo& info = peers[p];
+    addr_len = std::min<socklen_t>(addr_len, sizeof(info.addr));
+    memcpy(&info.addr, addr, addr_len);
+    info.addr_len = addr_len;
+    info.heard = now();
+    info.live = true;
+    by_address.emplace(std::move(key), p);
+    return p;
+}
+
+// Top up the source's bucket for the time since it was last topped up.
+bool DatagramHandler::admit(const sockaddr *addr, std::chrono::milliseconds t)
+{
+    const char *bytes;
+    size_t len;
+    if (addr->sa_family == AF_INET)
+    {
+        auto in = reinterpret_cast<const sockaddr_in *>(addr);
+        bytes = reinterpret_cast<const char *>(&in->sin_addr);
+        len = sizeof(in->sin_addr);
+    }
+    else if (addr->sa_family == AF_INET6)
+    {
+        auto in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+        bytes = reinterpret_cast<const char *>(&in6->sin6_addr);
+        len = sizeof(in6->sin6_addr);
+    }
+    else
+        return true;
+    Bucket& b = sources[std::hash<std::string_view>()(std::string_view(bytes, len))
+        % sources.size()];
+    b.tokens = std::min<uint64_t>(b.tokens + (t - b.refilled).count() * source_rate,
+            source_burst * 1000ull);
+    b.refilled = t;
+    if (b.tokens < 1000)
+        return false;
+    b.tokens -= 1000;
+    return true;
+}
+
+void DatagramHandler::forget(Peer p)
+{
+    if (p >= peers.size() or not peers[p].live)
+        return;
+    PeerInfo& info = peers[p];
+    by_address.erase(address_key(reinterpret_cast<sockaddr *>(&info.addr), info.addr_len));
+    info.live = false;
+    free_peers.push_back(p);
+    // Anything still queued for it goes nowhere, rather than to
+    // whoever gets its place next.
+    for (Outgoing& out : queue)
+    {
+        if (out.to == p and out.data)
+        {
+            queued -= out.data->size();
+            out.data = nullptr;
+        }
+    }
+}
+
+void DatagramHandler::set_peer_timeout(std::chrono::milliseconds t)
+{
+    peer_timeout = t;
+    if (t.count() > 0)
+        schedule(sweep_timer, t);
+    else
+        cancel(sweep_timer);
+}
+
+void DatagramHandler::sweep()
+{
+    std::chrono::milliseconds t = now();
+    for (Peer p = 0; p < peers.size(); ++p)
+    {
+        if (peers[p].live and t - peers[p].heard >= peer_timeout)
+        {
+            forget(p);
+            forgotten(p);
+        }
+    }
+    schedule(sweep_timer, peer_timeout);
+}
+
+void DatagramHandler::send(Peer to, const_array<uint8_t> b)
+{
+    queue_datagram(to, std::make_shared<std::string>(b.begin(), b.end()));
+}
+
+void DatagramHandler::send(Peer to, Segment s)
+{
+    queue_datagram(to, std::move(s));
+}
+
+void DatagramHandler::queue_datagram(Peer to, Segment s)
+{
+    if (to >= peers.size() or not peers[to].live or not s)
+        return;
+    if (max_output and queued + s->size() > max_output)
+        return;
+    bool was_empty = queue.empty();
+    queued += s->size();
+    queue.push_back({to, std::move(s)});
+    if (was_empty)
+        enable_write();
+}
+
+Handler::Status DatagramHandler::on_readable()
+{
+    mmsghdr msgs[BATCH];
+    iovec iov[BATCH];
+    sockaddr_storage addrs[BATCH];
+    for (size_t n = 0; n < READS_PER_WAKEUP; ++n)
+    {
+        for (size_t i = 0; i < BATCH; ++i)
+        {
+            iov[i].iov_base = inbox.get() + i * max_datagram;
+            iov[i].iov_len = max_datagram;
+            msgs[i].msg_hdr = msghdr {};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = recvmmsg(fd, msgs, BATCH, 0, nullptr);
+        if (r == -1)
+            // (or an ICMP error, from sending to a peer that is gone)
+            return errno == EAGAIN or errno == EINTR or errno == ECONNREFUSED
+                ? Handler::Status::KEEP
+                : Handler::Status::DROP;
+        std::chrono::milliseconds t = now();
+        for (int i = 0; i < r; ++i)
+        {
+            const msghdr& h = msgs[i].msg_hdr;
+            // cut short, so it's no good to anybody
+            if (h.msg_flags & MSG_TRUNC)
+                continue;
+            if (source_rate
+                    and not admit(reinterpret_cast<sockaddr *>(&addrs[i]), t))
+                continue;
+            Peer from = peer(reinterpret_cast<sockaddr *>(&addrs[i]), h.msg_namelen);
+            peers[from].heard = t;
+            received(from, const_array<uint8_t>(
+                        static_cast<uint8_t *>(iov[i].iov_base), msgs[i].msg_len));
+        }
+        if (size_t(r) < BATCH)
+            break;
+    }
+    return Handler::Status::KEEP;
+}
+
+Handler::Status DatagramHandler::on_writable()
+{
+    mmsghdr msgs[BATCH];
+    // a datagram per iovec, and several in one message when segmenting
+    iovec iov[BATCH * MAX_SEGMENTS];
+    alignas(cmsghdr) char control[BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    // how many queued datagrams are in each message
+    size_t counts[BATCH];
+    while (not queue.empty())
+    {
+        size_t m = 0, v = 0;
+        auto it = queue.begin();
+        while (m < BATCH and it != queue.end())
+        {
+            if (not it->data)
+            {
+                // for a peer that was forgotten; pretend it was sent
+                if (m == 0)
+                {
+                    queue.pop_front();
+                    it = queue.begin();
+                    continue;
+                }
+                break;
+            }
+            const Peer to = it->to;
+            const size_t size = it->data->size();
+            size_t n = 0;
+            // The segments are all the same size, except the last,
+            // which may be shorter.
+            while (true)
+            {
+                bool shorter = it->data->size() < size;
+                iov[v + n].iov_base = const_cast<char *>(it->data->data());
+                iov[v + n].iov_len = it->data->size();
+                ++n;
+                ++it;
+                if (not segment or not size or shorter or n == MAX_SEGMENTS
+                        or it == queue.end() or not it->data or it->to != to
+                        or it->data->size() > size
+                        or (n + 1) * size > MAX_SEGMENTED)
+                    break;
+            }
+            const PeerInfo& info = peers[to];
+            msghdr& h = msgs[m].msg_hdr;
+            h = msghdr {};
+            h.msg_name = const_cast<sockaddr_storage *>(&info.addr);
+            h.msg_namelen = info.addr_len;
+            h.msg_iov = &iov[v];
+            h.msg_iovlen = n;
+            if (n > 1)
+            {
+                h.msg_control = control[m];
+                h.msg_controllen = sizeof(control[m]);
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&h);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = size;
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+            counts[m] = n;
+            v += n;
+            ++m;
+        }
+        if (m == 0)
+            break;
+        int r = sendmmsg(fd, msgs, m, 0);
+        if (r == -1)
+        {
+            if (errno == EAGAIN)
+                return Handler::Status::KEEP;
+            if (errno == EINTR)
+                continue;
+            if (counts[0] > 1 and (errno == EIO or errno == EINVAL))
+            {
+                // the kernel (or the NIC) can't segment after all
+                segment = false;
+                continue;
+            }
+            // e.g. an ICMP error from an earlier datagram: this one
+            // is lost, like it would be anywhere else on the way
+            r = 1;
+        }
+        for (int i = 0; i < r; ++i)
+        {
+            for (size_t k = 0; k < counts[i]; ++k)
+            {
+                if (queue.front().data)
+                    queued -= queue.front().data->size();
+                queue.pop_front();
+            }
+        }
+    }
+    return Handler::Status::DROP;
+}
+
+} // namespace net
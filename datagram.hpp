@@ -0,0 +1,128 @@
+#ifndef DATAGRAM_HPP
+#define DATAGRAM_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "net.hpp"
+
+namespace net
+{
+
+struct DatagramOptions : ListenOptions
+{
+    // (Of ListenOptions, only reuse_port, the buffer sizes, and
+    // busy_poll apply.)
+
+    // Longer datagrams are thrown away on arrival. Zero (the default)
+    // means 2048, which is more than fits in a packet anyway.
+    size_t max_datagram;
+    // While this many bytes are waiting to be sent, more are thrown
+    // away. Zero (the default) means no limit.
+    size_t max_output;
+    // Send consecutive datagrams of the same size to the same peer as
+    // one, to be split up by the kernel or the NIC (UDP_SEGMENT), if
+    // the kernel can.
+    bool segment;
+    // A token bucket per source address (whatever its port): take at
+    // most this many datagrams per second from it on average, or
+    // source_burst at once, and drop the rest unseen, before they are
+    // given a place in the peer table. Addresses share buckets in a
+    // table of fixed size, so a flood of forged ones costs no memory.
+    // Zero (the default) means no limit.
+    unsigned source_rate;
+    unsigned source_burst;
+
+    DatagramOptions()
+    : ListenOptions()
+    , max_datagram()
+    , max_output()
+    , segment()
+    , source_rate()
+    , source_burst()
+    {}
+};
+
+// Datagrams on one UDP socket, for traffic that doesn't mind being
+// lost now and then, like game state for spectators or presence pings:
+// there is no connection, and nothing kept per peer but its address.
+//
+// Datagrams are received and sent in batches (recvmmsg, sendmmsg),
+// so a burst costs a few calls rather than one per datagram.
+class DatagramHandler : public Handler
+{
+public:
+    // A peer's place in the table, until it is forgotten.
+    typedef uint32_t Peer;
+private:
+    struct PeerInfo
+    {
+        sockaddr_storage addr;
+        socklen_t addr_len;
+        std::chrono::milliseconds heard;
+        bool live;
+    };
+    struct Outgoing
+    {
+        Peer to;
+        Segment data;
+    };
+    struct Bucket
+    {
+        // in thousandths of a datagram, so refilling is exact per ms
+        uint64_t tokens;
+        std::chrono::milliseconds refilled;
+    };
+
+    const size_t max_datagram;
+    const size_t max_output;
+    bool segment;
+    const unsigned source_rate;
+    const unsigned source_burst;
+    std::vector<Bucket> sources;
+    std::vector<PeerInfo> peers;
+    std::vector<Peer> free_peers;
+    std::unordered_map<std::string, Peer> by_address;
+    std::deque<Outgoing> queue;
+    size_t queued;
+    // for one batch of recvmmsg()
+    std::unique_ptr<uint8_t[]> inbox;
+    std::chrono::milliseconds peer_timeout;
+    Timer sweep_timer;
+
+    void sweep();
+    // Whether the source has a token left, taking it if so.
+    bool admit(const sockaddr *addr, std::chrono::milliseconds t);
+    void queue_datagram(Peer to, Segment s);
+    // Called for every datagram, from whoever.
+    virtual void received(Peer from, const_array<uint8_t> datagram) = 0;
+    // Called when a peer is forgotten for being quiet too long.
+    virtual void forgotten(Peer) {}
+public:
+    DatagramHandler(uint16_t port, IPv4 iface, DatagramOptions opts=DatagramOptions());
+    DatagramHandler(uint16_t port, IPv6 iface, DatagramOptions opts=DatagramOptions());
+
+    // Look up (or add) the peer with the address.
+    Peer peer(const sockaddr *addr, socklen_t addr_len);
+    void forget(Peer p);
+    // Forget peers that have sent nothing for this long (checked every
+    // so often). Zero (the default) means never.
+    void set_peer_timeout(std::chrono::milliseconds t);
+    // Queue a datagram, unless too much is queued already.
+    void send(Peer to, const_array<uint8_t> b);
+    // One that is shared, e.g. with every spectator of a game.
+    void send(Peer to, Segment s);
+
+    virtual Handler::Status on_readable() override;
+    virtual Handler::Status on_writable() override;
+};
+
+} // namespace net
+
+#endif // DATAGRAM_HPP
@@ -0,0 +1,88 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "echo.hpp"
+#include "cli.hpp"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace echo
+{
+
+// A command and its argument, copied out of the input, which is only
+// valid until the next co_await.
+typedef std::pair<std::string, std::string> Command;
+
+static
+net::Task<Command> read_command(net::Stream& s)
+{
+    const_string line = co_await s.read_line();
+    auto pair = cli::split_first(line);
+    if (not pair.first and not pair.second)
+        // unbalanced quotes
+        co_return Command("?", "");
+    const_string arg = cli::trim(pair.second);
+    co_return Command(std::string(pair.first.begin(), pair.first.end()),
+            std::string(arg.begin(), arg.end()));
+}
+
+// Waits whenever the output has backed up, so a client that doesn't
+// read is only ever sent so much.
+static
+net::Task<> repeat(net::Stream& s, uint64_t n, std::string text)
+{
+    // all the same line, shared
+    net::Segment line = std::make_shared<std::string>(text + "\r\n");
+    for (uint64_t i = 0; i != n; ++i)
+        co_await s.write(line);
+}
+
+net::Task<> serve(net::Stream& s, size_t max_blob)
+{
+    co_await s.write(const_string("Echo: say, blob, repeat, or quit.\r\n"));
+    while (true)
+    {
+        Command c = co_await read_command(s);
+        if (c.first == "quit")
+            co_return;
+        if (c.first.empty())
+            continue;
+        const_string arg(c.second.data(), c.second.size());
+        if (c.first == "say")
+        {
+            c.second += "\r\n";
+            co_await s.write(const_string(c.second));
+            continue;
+        }
+        if (c.first == "blob")
+        {
+            size_t n;
+            if (not cli::extract(arg, &n) or n > max_blob)
+            {
+                co_await s.write(const_string("Error: blob <bytes>, not too many\r\n"));
+                continue;
+            }
+            // (written, which copies it, before the next co_await)
+            const_array<uint8_t> bytes = co_await s.read_exact(n);
+            co_await s.write(bytes);
+            continue;
+        }
+        if (c.first == "repeat")
+        {
+            auto pair = cli::split_first(arg);
+            uint64_t n;
+            if (not pair.first or not cli::extract(pair.first, &n))
+            {
+                co_await s.write(const_string("Error: repeat <count> <text>\r\n"));
+                continue;
+            }
+            const_string text = cli::trim(pair.second);
+            co_await repeat(s, n, std::string(text.begin(), text.end()));
+            continue;
+        }
+        co_await s.write(const_string("Error: no such command\r\n"));
+    }
+}
+
+} // namespace echo
@@ -0,0 +1,24 @@
+#ifndef ECHO_HPP
+#define ECHO_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstddef>
+
+#include "coro.hpp"
+
+namespace echo
+{
+
+// A service for testing clients (and the network) against, written as
+// a coroutine (see net::Stream). Each line is a command:
+//  say <text>              -> the text, back
+//  blob <n>, then n bytes  -> the bytes, back
+//  repeat <n> <text>       -> the text, back n times
+//  quit
+// A blob may be up to max_blob bytes.
+net::Task<> serve(net::Stream& s, size_t max_blob);
+
+} // namespace echo
+
+#endif // ECHO_HPP
@@ -0,0 +1,303 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "federation.hpp"
+#include "chat.hpp"
+#include "make-unique.hpp"
+
+#include <cstdio>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <set>
+
+namespace chat
+{
+
+// The opcodes of frames on a link.
+enum class Op : uint8_t
+{
+    // first thing in each direction: the name of the node, after
+    // the length of the secret and the secret, from the node that
+    // connected, and just the name in answer
+    HELLO = 1,
+    // the length of the name of a room, the name, then a line
+    // (already rendered) that was said in it
+    SAY = 2,
+    // a nick
+    CLAIM = 3,
+    RELEASE = 4,
+};
+
+// Lines can be long, but not this long (see --max-line).
+constexpr size_t MAX_FRAME = 16 << 20;
+
+// One frame: the opcode, then the parts, all but the last of which
+// have their lengths in front.
+static
+void append_frame(std::string *out, Op op, const_array<const_string> parts)
+{
+    std::string payload(1, char(op));
+    for (size_t i = 0; i != parts.size(); ++i)
+    {
+        const_string part = parts.begin()[i];
+        if (i + 1 != parts.size())
+            net::append_length(&payload, part.size());
+        payload.append(part.data(), part.size());
+    }
+    net::append_length(out, payload.size());
+    out->append(payload);
+}
+
+static
+net::Segment frame(Op op, const_array<const_string> parts)
+{
+    auto out = std::make_shared<std::string>();
+    append_frame(out.get(), op, parts);
+    return out;
+}
+
+// Without giving away, by how long it takes, how much of it was right.
+static
+bool same_secret(const_string a, const_string b)
+{
+    if (a.size() != b.size())
+        return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i != a.size(); ++i)
+        diff |= a.begin()[i] ^ b.begin()[i];
+    return not diff;
+}
+
+class Federation::Link
+{
+    Federation *owner;
+public:
+    net::Connector connector;
+    // the connection, while there is one
+    net::BufferHandler *out;
+    // the node at the other end, once it says
+    std::string node;
+
+    Link(Federation *f, const sockaddr *addr, socklen_t addr_len)
+    : owner(f)
+    , connector(f->home, addr, addr_len,
+            [this](int fd) { return this->connected(fd); })
+    , out()
+    , node()
+    {}
+
+    std::unique_ptr<net::Handler> connected(int fd);
+};
+
+// Our end of a link we made, which just waits for the other end to
+// say hello; everything else is written to it by Federation::send().
+class Federation::Outbound : public net::FrameHandler
+{
+    Link *link;
+public:
+    Outbound(Link *l)
+    : link(l)
+    {}
+
+    ~Outbound()
+    {
+        if (not link->node.empty())
+            fprintf(stderr, "federation: lost the link to %s\n",
+                    link->node.c_str());
+        link->node.clear();
+        link->out = nullptr;
+        link->connector.lost();
+    }
+
+    // links are only ever framed
+    void handle(const_string) override {}
+    void handle_frame(const_array<uint8_t> frame) override
+    {
+        if (frame.empty() or Op(frame.front()) != Op::HELLO
+                or not link->node.empty())
+        {
+            this->wbh->hang_up();
+            return;
+        }
+        const_string name = frame.cut(1).second;
+        link->node.assign(name.begin(), name.end());
+        link->connector.established();
+        fprintf(stderr, "federation: linked to %s\n", link->node.c_str());
+    }
+};
+
+// The other end of a link some node made to us, on whichever
+// thread accepted it.
+class Federation::Inbound : public net::FrameHandler
+{
+    std::string node;
+    // the nicks it has claimed, to let go of when it does
+    std::set<std::string> held;
+public:
+    ~Inbound()
+    {
+        for (const std::string& nick : held)
+            free_remote_nick(nick);
+    }
+
+    void handle(const_string) override {}
+    void handle_frame(const_array<uint8_t> frame) override;
+};
+
+void Federation::Inbound::handle_frame(const_array<uint8_t> frame)
+{
+    if (frame.empty())
+    {
+        this->wbh->hang_up();
+        return;
+    }
+    Op op = Op(frame.front());
+    const_array<uint8_t> rest = frame.cut(1).second;
+    if ((op == Op::HELLO) != node.empty())
+    {
+        this->wbh->hang_up();
+        return;
+    }
+    switch (op)
+    {
+    case Op::HELLO:
+    {
+        uint64_t n;
+        if (not net::take_length(&rest, &n) or n > rest.size())
+        {
+            this->wbh->hang_up();
+            return;
+        }
+        auto parts = rest.cut(n);
+        if (not same_secret(parts.first, const_string(federation->secret)))
+        {
+            fprintf(stderr, "federation: a link with the wrong secret\n");
+            this->wbh->hang_up();
+            return;
+        }
+        node.assign(parts.second.begin(), parts.second.end());
+        // or it would hear everything twice
+        if (node == federation->node)
+        {
+            fprintf(stderr, "federation: %s is linked to itself\n", node.c_str());
+            this->wbh->hang_up();
+            return;
+        }
+        std::string hello;
+        append_frame(&hello, Op::HELLO, {federation->node});
+        this->wbh->write(const_string(hello));
+        break;
+    }
+    case Op::SAY:
+    {
+        uint64_t n;
+        if (not net::take_length(&rest, &n) or n > rest.size())
+        {
+            this->wbh->hang_up();
+            return;
+        }
+        auto parts = rest.cut(n);
+        const_string line = parts.second;
+        Room::relay(parts.first,
+                std::make_shared<std::string>(line.begin(), line.end()));
+        break;
+    }
+    case Op::CLAIM:
+    {
+        std::string nick(rest.begin(), rest.end());
+        // If it was also taken here, the node first by name keeps it.
+        if (held.insert(nick).second)
+            hold_remote_nick(nick, node < federation->node);
+        break;
+    }
+    case Op::RELEASE:
+    {
+        std::string nick(rest.begin(), rest.end());
+        if (held.erase(nick))
+            free_remote_nick(nick);
+        break;
+    }
+    default:
+        // a newer node, or garbage
+        this->wbh->hang_up();
+        break;
+    }
+}
+
+Federation::Federation(std::string n, std::string s, net::SocketSet *h)
+: node(n)
+, secret(s)
+, home(h)
+, links()
+{}
+
+Federation::~Federation() = default;
+
+void Federation::add_peer(const sockaddr *addr, socklen_t addr_len)
+{
+    links.push_back(make_unique<Link>(this, addr, addr_len));
+}
+
+std::unique_ptr<net::Handler> Federation::Link::connected(int fd)
+{
+    // Links carry lots of little messages. (This just fails for
+    // a unix socket, which doesn't wait anyway.)
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Everything claimed so far, ahead of the claims and releases
+    // that are still in the mailbox (repeats are harmless).
+    std::string hello;
+    append_frame(&hello, Op::HELLO, {owner->secret, owner->node});
+    for (const std::string& nick : local_nicks())
+        append_frame(&hello, Op::CLAIM, {nick});
+    auto bh = make_unique<net::BufferHandler>(
+            make_unique<net::FrameParser>(make_unique<Outbound>(this), MAX_FRAME),
+            fd, const_string(hello));
+    // A peer that can't keep up gets a fresh start.
+    bh->set_output_limits(MAX_FRAME / 4, MAX_FRAME, 4 * MAX_FRAME);
+    out = bh.get();
+    return bh;
+}
+
+void Federation::start()
+{
+    for (auto& link : links)
+        link->connector.start();
+}
+
+std::unique_ptr<net::Handler> Federation::accept(int fd, const sockaddr *, socklen_t)
+{
+    // (and it says hello once the other node has)
+    auto bh = make_unique<net::BufferHandler>(
+            make_unique<net::FrameParser>(make_unique<Inbound>(), MAX_FRAME),
+            fd);
+    return bh;
+}
+
+void Federation::send(net::Segment frame)
+{
+    home->post([this, frame]()
+            {
+                for (auto& link : this->links)
+                    if (link->out)
+                        link->out->write(frame);
+            });
+}
+
+void Federation::said(const std::string& room, net::Segment line)
+{
+    send(frame(Op::SAY, {room, *line}));
+}
+
+void Federation::claimed(const std::string& nick)
+{
+    send(frame(Op::CLAIM, {nick}));
+}
+
+void Federation::released(const std::string& nick)
+{
+    send(frame(Op::RELEASE, {nick}));
+}
+
+} // namespace chat
@@ -0,0 +1,67 @@
+#ifndef FEDERATION_HPP
+#define FEDERATION_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "net.hpp"
+
+namespace chat
+{
+
+// Links this server to others (nodes), so that a room can have
+// chatters on all of them, and a nick is only taken on one (or if two
+// take it at once, only one keeps it, see chat::hold_remote_nick()).
+//
+// Every node connects to each of the others (its peers), and only
+// ever sends on the links it made: what is said in its rooms, and
+// the nicks taken and let go by its own clients. So nothing has to
+// be passed on again, and it doesn't matter who connects first.
+// What is said while a link is down is lost, but all the nicks are
+// sent again when it comes back.
+//
+// Links speak in frames like the binary protocol of main (see
+// net::FrameParser), each starting with an opcode. Anybody who can
+// reach a node can talk to it, so every node is given the same secret,
+// and a link is not listened to until it has said so. The secret is
+// only ever sent by the node that connects, so the other end never
+// gives it away to whoever connects.
+class Federation
+{
+    class Link;
+    class Outbound;
+    class Inbound;
+
+    const std::string node;
+    const std::string secret;
+    net::SocketSet *home;
+    std::vector<std::unique_ptr<Link>> links;
+
+    // Queue a frame on every link that is up, from any thread.
+    void send(net::Segment frame);
+
+    Federation(const Federation&) = delete;
+public:
+    // The links are kept by home, and this must outlive it.
+    Federation(std::string node, std::string secret, net::SocketSet *home);
+    ~Federation();
+    void add_peer(const sockaddr *addr, socklen_t addr_len);
+    // Start connecting to the peers.
+    void start();
+    // For a ListenHandler, to take the links of other nodes.
+    // Only once chat::federation is set.
+    static
+    std::unique_ptr<net::Handler> accept(int fd, const sockaddr *addr, socklen_t addr_len);
+
+    // Called by chat, on any thread.
+    void said(const std::string& room, net::Segment line);
+    void claimed(const std::string& nick);
+    void released(const std::string& nick);
+};
+
+} // namespace chat
+
+#endif // FEDERATION_HPP
@@ -0,0 +1,393 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "handoff.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <condition_variable>
+#include <mutex>
+
+namespace net
+{
+
+// Each item is a header, carrying the fd, then the payload. The
+// payload of a connection is its input and output, each with its
+// length in front (see append_length()), then its state.
+enum class Kind : uint32_t
+{
+    END = 0,
+    LISTENER = 1,
+    CONNECTION = 2,
+};
+
+struct Header
+{
+    Kind kind;
+    uint32_t size;
+};
+
+// the new process says so once it has everything
+constexpr char ASK = '?';
+constexpr char DONE = '!';
+
+// Long enough for millions of connections, but everything is stopped
+// meanwhile, so a new process that hangs must not hang this one.
+constexpr int TIMEOUT_SECONDS = 10;
+
+static
+bool set_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    timeval timeout {};
+    timeout.tv_sec = TIMEOUT_SECONDS;
+    if (flags == -1 or fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1
+            or setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+            or setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+    {
+        fprintf(stderr, "handoff: can't make the socket blocking: %m\n");
+        return false;
+    }
+    return true;
+}
+
+static
+bool write_all(int fd, const_string s)
+{
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n)
+    {
+        ssize_t r = ::write(fd, p, n);
+        if (r == -1 and errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static
+bool read_all(int fd, char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t r = ::read(fd, p, n);
+        if (r == -1 and errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static
+bool send_item(int sock, Kind kind, int fd, const std::string& payload)
+{
+    Header header {kind, uint32_t(payload.size())};
+    iovec iov {&header, sizeof(header)};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    if (fd != -1)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t r;
+    do
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    while (r == -1 and errno == EINTR);
+    return r == sizeof(header) and write_all(sock, payload);
+}
+
+// Returns false at the end, as well as on failure (with *fd still -1).
+static
+bool receive_item(int sock, Kind *kind, int *fd, std::string *payload)
+{
+    Header header;
+    iovec iov {&header, sizeof(header)};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r;
+    do
+        r = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    while (r == -1 and errno == EINTR);
+    *fd = -1;
+    if (r != sizeof(header))
+        return false;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_RIGHTS
+                and cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    *kind = header.kind;
+    payload->resize(header.size);
+    return header.kind != Kind::END and *fd != -1
+        and read_all(sock, &(*payload)[0], header.size);
+}
+
+// Everything that might touch a handler is stopped until thawed.
+struct Freeze
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t stopped;
+    bool thawed;
+
+    Freeze()
+    : lock()
+    , changed()
+    , stopped()
+    , thawed()
+    {}
+};
+
+class HandoffHandler : public Handler
+{
+    ReactorGroup *group;
+
+    bool send_all(const std::vector<Handover>& items);
+public:
+    HandoffHandler(ReactorGroup *g, int fd)
+    : Handler(fd, true, false)
+    , group(g)
+    {}
+
+    virtual Handler::Status on_readable() override;
+    virtual Handler::Status on_writable() override
+    {
+        return Handler::Status::DROP;
+    }
+};
+
+bool HandoffHandler::send_all(const std::vector<Handover>& items)
+{
+    if (not set_blocking(fd))
+        return false;
+    for (const Handover& item : items)
+    {
+        std::string payload;
+        if (not item.listening)
+        {
+            append_length(&payload, item.input.size());
+            payload += item.input;
+            append_length(&payload, item.output.size());
+            payload += item.output;
+            payload += item.state;
+        }
+        if (not send_item(fd, item.listening ? Kind::LISTENER : Kind::CONNECTION,
+                    item.fd, payload))
+            return false;
+    }
+    char done;
+    return send_item(fd, Kind::END, -1, std::string())
+        and read_all(fd, &done, 1) and done == DONE;
+}
+
+Handler::Status HandoffHandler::on_readable()
+{
+    char ask;
+    if (::read(fd, &ask, 1) != 1 or ask != ASK)
+        return Handler::Status::DROP;
+
+    // Stop every other set where it stands, between two events.
+    auto freeze = std::make_shared<Freeze>();
+    SocketSet *here = SocketSet::current();
+    size_t others = 0;
+    for (size_t i = 0; i < group->size(); ++i)
+    {
+        if (&(*group)[i] == here)
+            continue;
+        ++others;
+        (*group)[i].post([freeze]()
+                {
+                    std::unique_lock<std::mutex> guard(freeze->lock);
+                    ++freeze->stopped;
+                    freeze->changed.notify_all();
+                    freeze->changed.wait(guard, [&freeze]() { return freeze->thawed; });
+                });
+    }
+    {
+        std::unique_lock<std::mutex> guard(freeze->lock);
+        freeze->changed.wait(guard,
+                [&freeze, others]() { return freeze->stopped == others; });
+    }
+
+    std::vector<Handover> items;
+    bool ok = true;
+    for (size_t i = 0; ok and i < group->size(); ++i)
+        ok = (*group)[i].hand_over(&items);
+    if (not ok)
+        fprintf(stderr, "handoff: only possible with the epoll backend\n");
+    else if (send_all(items))
+    {
+        fprintf(stderr, "handoff: handed over %zu sockets, exiting\n", items.size());
+        fflush(stdout);
+        fflush(stderr);
+        _exit(0);
+    }
+    else
+        fprintf(stderr, "handoff: failed, carrying on\n");
+
+    {
+        std::lock_guard<std::mutex> guard(freeze->lock);
+        freeze->thawed = true;
+    }
+    freeze->changed.notify_all();
+    return Handler::Status::DROP;
+}
+
+std::unique_ptr<Handler> offer_handoff(ReactorGroup *group, int fd)
+{
+    return std::unique_ptr<Handler>(new HandoffHandler(group, fd));
+}
+
+bool receive_handoff(const_string path, std::vector<Handover> *out)
+{
+    sockaddr_un addr {};
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return false;
+    // nobody there is the usual case
+    if (connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    {
+        close(sock);
+        return errno == ENOENT or errno == ECONNREFUSED;
+    }
+    if (not set_blocking(sock) or not write_all(sock, const_string(&ASK, 1)))
+    {
+        close(sock);
+        return false;
+    }
+
+    std::vector<Handover> items;
+    Kind kind = Kind::END;
+    int fd;
+    std::string payload;
+    bool ok = true;
+    while (receive_item(sock, &kind, &fd, &payload))
+    {
+        Handover item;
+        item.fd = fd;
+        item.listening = kind == Kind::LISTENER;
+        const_array<uint8_t> rest = const_string(payload);
+        uint64_t n;
+        if (not item.listening)
+        {
+            ok = take_length(&rest, &n) and n <= rest.size();
+            if (ok)
+            {
+                auto parts = rest.cut(n);
+                item.input.assign(parts.first.begin(), parts.first.end());
+                rest = parts.second;
+                ok = take_length(&rest, &n) and n <= rest.size();
+            }
+            if (ok)
+            {
+                auto parts = rest.cut(n);
+                item.output.assign(parts.first.begin(), parts.first.end());
+                item.state.assign(parts.second.begin(), parts.second.end());
+            }
+        }
+        items.push_back(std::move(item));
+        fd = -1;
+        if (not ok)
+            break;
+    }
+    // It's done once it has exited, and closed its end. Until then,
+    // it still has everything too (though it isn't doing anything).
+    char eof;
+    ok = ok and kind == Kind::END and fd == -1
+        and write_all(sock, const_string(&DONE, 1))
+        and ::read(sock, &eof, 1) == 0;
+    close(sock);
+    if (not ok)
+    {
+        if (fd != -1)
+            close(fd);
+        for (Handover& item : items)
+            close(item.fd);
+        fprintf(stderr, "handoff: failed to take over from %s\n", path.data());
+        return false;
+    }
+    *out = std::move(items);
+    return true;
+}
+
+static
+int take_listener(std::vector<Handover> *items, const sockaddr *addr, socklen_t addr_len)
+{
+    for (auto it = items->begin(); it != items->end(); ++it)
+    {
+        if (not it->listening)
+            continue;
+        sockaddr_storage bound {};
+        socklen_t bound_len = sizeof(bound);
+        if (getsockname(it->fd, reinterpret_cast<sockaddr *>(&bound), &bound_len) == -1
+                or bound_len != addr_len or memcmp(&bound, addr, addr_len) != 0)
+            continue;
+        int fd = it->fd;
+        items->erase(it);
+        return fd;
+    }
+    return -1;
+}
+
+int take_listener(std::vector<Handover> *items, uint16_t port, IPv4 iface)
+{
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = iface;
+    return take_listener(items, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+}
+
+int take_listener(std::vector<Handover> *items, uint16_t port, IPv6 iface)
+{
+    sockaddr_in6 addr {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = iface;
+    return take_listener(items, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+}
+
+int take_listener(std::vector<Handover> *items, const_string path)
+{
+    sockaddr_un addr {};
+    if (path.size() >= sizeof(addr.sun_path))
+        return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    // as long as getsockname() says, which is up to the terminator
+    return take_listener(items, reinterpret_cast<sockaddr *>(&addr),
+            offsetof(sockaddr_un, sun_path) + path.size() + 1);
+}
+
+} // namespace net
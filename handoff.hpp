@@ -0,0 +1,46 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+//
+// Restarting without dropping anything: the old process passes every
+// listener and connection (see Handover) to the new one over a unix
+// socket, the fds themselves going with SCM_RIGHTS, and then exits.
+// The listeners are the same sockets in both, so connections that
+// arrive in the meantime just wait in their backlogs.
+//
+//  old: listen on path, with offer_handoff() for each connection
+//  new: receive_handoff(path, &items), then take_listener() instead
+//       of making each listener, and rebuild the connections from
+//       what their parsers saved (see Parser::save())
+
+#include <vector>
+
+#include "net.hpp"
+
+namespace net
+{
+
+// The handler of a connection to the socket that new processes take
+// over from. Once it asks, every set of the group is stopped, and is
+// handed over; when the new process says it has everything, this one
+// exits on the spot (cleaning up would only disturb what it handed
+// over). If anything goes wrong, the sets carry on as they were.
+// Every other set must still be polling, to be stopped.
+std::unique_ptr<Handler> offer_handoff(ReactorGroup *group, int fd);
+
+// Take over from the process offering a handoff at path, which has
+// exited by the time this returns. If nobody is there, out is just
+// left empty. False if there was somebody, but it didn't work out;
+// then the old process carries on.
+bool receive_handoff(const_string path, std::vector<Handover> *out);
+
+// Take a listener out of items, if one of them is bound to the same
+// address as the arguments of the ListenHandler constructors, else -1.
+int take_listener(std::vector<Handover> *items, uint16_t port, IPv4 iface);
+int take_listener(std::vector<Handover> *items, uint16_t port, IPv6 iface);
+int take_listener(std::vector<Handover> *items, const_string path);
+
+} // namespace net
+
+#endif // HANDOFF_HPP
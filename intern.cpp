@@ -0,0 +1,120 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "intern.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <string_view>
+
+static
+size_t hash_name(const_string name)
+{
+    return std::hash<std::string_view>()(std::string_view(name.data(), name.size()));
+}
+
+Interner::Interner()
+: slots(16)
+, names()
+, hashes()
+, holders()
+, free_ids()
+{}
+
+// The slot holding the name, or else the empty one where it would go.
+size_t Interner::probe(const_string name, size_t hash)
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        Id s = slots[i];
+        if (not s)
+            return i;
+        const std::string& n = names[s - 1];
+        if (hashes[s - 1] == hash and n.size() == name.size()
+                and std::equal(n.begin(), n.end(), name.begin()))
+            return i;
+    }
+}
+
+void Interner::grow()
+{
+    std::vector<Id> old(slots.size() * 2);
+    old.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (Id s : old)
+    {
+        if (not s)
+            continue;
+        size_t i = hashes[s - 1] & mask;
+        while (slots[i])
+            i = (i + 1) & mask;
+        slots[i] = s;
+    }
+}
+
+// Empty the slot, moving up whatever after it would not be found
+// with a gap in the way (so there is no need for tombstones).
+void Interner::unlink(size_t i)
+{
+    size_t mask = slots.size() - 1;
+    for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask)
+    {
+        size_t home = hashes[slots[j] - 1] & mask;
+        // whether it is found from its home without passing i
+        bool reachable = i < j
+            ? i < home and home <= j
+            : i < home or home <= j;
+        if (reachable)
+            continue;
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i] = 0;
+}
+
+Interner::Id Interner::find(const_string name)
+{
+    return slots[probe(name, hash_name(name))] - 1;
+}
+
+Interner::Id Interner::intern(const_string name)
+{
+    size_t hash = hash_name(name);
+    size_t i = probe(name, hash);
+    if (slots[i])
+    {
+        Id id = slots[i] - 1;
+        ++holders[id];
+        return id;
+    }
+    Id id;
+    if (not free_ids.empty())
+    {
+        id = free_ids.back();
+        free_ids.pop_back();
+        names[id].assign(name.begin(), name.end());
+        hashes[id] = hash;
+        holders[id] = 1;
+    }
+    else
+    {
+        id = names.size();
+        names.emplace_back(name.begin(), name.end());
+        hashes.push_back(hash);
+        holders.push_back(1);
+    }
+    slots[i] = id + 1;
+    if ((names.size() - free_ids.size()) * 2 > slots.size())
+        grow();
+    return id;
+}
+
+void Interner::release(Id id)
+{
+    if (--holders[id])
+        return;
+    unlink(probe(const_string(names[id].data(), names[id].size()), hashes[id]));
+    // (and not just clear(), which would keep a long one's memory)
+    std::string().swap(names[id]);
+    free_ids.push_back(id);
+}
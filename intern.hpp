@@ -0,0 +1,60 @@
+#ifndef INTERN_HPP
+#define INTERN_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "const_array.hpp"
+
+// Names (of nicks, rooms, games ...), each stored once, and numbered
+// while anybody holds them. The number of a name doesn't change while
+// it is held, so whatever is kept about names can just be a vector
+// indexed by it; once the last holder lets go, the number goes to the
+// next new name, so the vectors only grow as big as the most names
+// held at once.
+//
+// Looking up a name allocates nothing, and neither does interning one
+// that is already held.
+//
+// There is no locking: each user has its own, which it already needs
+// for whatever it keeps by number.
+class Interner
+{
+public:
+    typedef uint32_t Id;
+    static constexpr Id NONE = Id(-1);
+private:
+    // Open addressing with linear probing, never more than half full.
+    // Each slot is the id of a name plus one, or zero for none.
+    std::vector<Id> slots;
+    // a deque, so that the names don't move as more are added
+    std::deque<std::string> names;
+    std::vector<size_t> hashes;
+    std::vector<uint32_t> holders;
+    std::vector<Id> free_ids;
+
+    size_t probe(const_string name, size_t hash);
+    void grow();
+    void unlink(size_t slot);
+public:
+    Interner();
+
+    // NONE if nobody holds the name.
+    Id find(const_string name);
+    // Hold the name (once more), and get its id.
+    Id intern(const_string name);
+    // Let go of it, as many times as it was interned.
+    void release(Id id);
+    // Valid, and unchanged, for as long as the name is held.
+    const std::string& name(Id id) { return names[id]; }
+    // Ids run from zero to one less than this, though some of them
+    // may be free.
+    size_t size() { return names.size(); }
+};
+
+#endif // INTERN_HPP
@@ -4,23 +4,58 @@
 #include "net.hpp"
 #include "cli.hpp"
 #include "chat.hpp"
+#include "datagram.hpp"
+#include "echo.hpp"
+#include "federation.hpp"
+#include "handoff.hpp"
+#include "intern.hpp"
 #include "conquest-player.hpp"
+#include "pool.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <csignal>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
-using namespace std::placeholders;
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 class GameInstance;
 class GameShell;
 
-class GameShell : public net::LineHandler, private cli::Shell
+// Opcodes of the binary protocol, which is spoken on its own port.
+// Each frame (see net::FrameParser) is an opcode byte, followed by
+// the argument as raw text, if any. Replies are the same text that
+// a person would get.
+enum class Op : uint8_t
+{
+    SAY = 1,
+    NICK = 2,
+    JOIN = 3,
+    BEGIN = 4,
+    QUIT = 5,
+    TURN = 6,
+    MAP = 7,
+};
+
+class GameShell : public net::FrameHandler, public chat::NickHolder,
+    public Pooled<GameShell>
 {
     friend class GameInstance;
 
     std::string nick;
+    // spoken to with the binary protocol
+    const bool binary;
+    // the reactor that wbh belongs to
+    net::SocketSet *home;
     std::unique_ptr<chat::Connection> _chat;
+    // the name of the chat room, if _chat is set
+    std::string room;
     std::shared_ptr<GameInstance> _game;
     // really should be a subclass of AsynchronousPlayer,
     // just to enable logging
@@ -36,56 +71,100 @@ class GameShell : public net::LineHandler, private cli::Shell
     cli::Status cmd_begin(const_string);
     cli::Status cmd_quit(const_string);
     cli::Status cmd_turn(const_string);
+    cli::Status cmd_map(const_string);
+    cli::Status cmd_rooms(const_string);
 
-    void _add_commands()
-    {
-        this->_default = std::bind(&GameShell::cmd_nosuch, this, _1);
-        this->add_command("say", "say a line of text",
-                std::bind(&GameShell::cmd_say, this, _1));
-        this->add_command("nick", "change your nickname",
-                std::bind(&GameShell::cmd_nick, this, _1));
-        this->add_command("help", "get help (duh)",
-                std::bind(&GameShell::cmd_help, this, _1));
-        this->_commands["xyzzy"] =
-                std::bind(&GameShell::cmd_xyzzy, this, _1);
-        this->add_command("join", "join a new game",
-               std::bind(&GameShell::cmd_new, this, _1));
-        this->add_command("begin", "actually start the new game",
-               std::bind(&GameShell::cmd_begin, this, _1));
-        this->add_command("quit", "quit the current game",
-               std::bind(&GameShell::cmd_quit, this, _1));
-        this->add_command("turn", "end the current turn of the game",
-               std::bind(&GameShell::cmd_turn, this, _1));
+    // What the commands do, once the arguments are parsed,
+    // for both the text and binary protocols.
+    void say(const_string text);
+    cli::Status rename(const_string nick);
+    // once chat has it
+    void renamed(const_string nick);
+    void join(const_string gamename);
+    cli::Status begin();
+    cli::Status leave();
+    cli::Status end_turn();
+    cli::Status map();
+
+    typedef cli::CommandTable<GameShell> Commands;
+    static
+    Commands make_commands()
+    {
+        Commands c(&GameShell::cmd_nosuch);
+        c.add("say", "say a line of text", &GameShell::cmd_say);
+        c.add("nick", "change your nickname", &GameShell::cmd_nick);
+        c.add("help", "get help (duh)", &GameShell::cmd_help);
+        c.add("xyzzy", "", &GameShell::cmd_xyzzy);
+        c.add("join", "join a new game", &GameShell::cmd_new);
+        c.add("begin", "actually start the new game", &GameShell::cmd_begin);
+        c.add("quit", "quit the current game", &GameShell::cmd_quit);
+        c.add("turn", "end the current turn of the game", &GameShell::cmd_turn);
+        c.add("map", "draw the planets you know of", &GameShell::cmd_map);
+        c.add("rooms", "list the chat rooms, and how busy they are", &GameShell::cmd_rooms);
+        return c;
     }
+    // built once, for all shells on all threads
+    static
+    const Commands& commands()
+    {
+        static const Commands c = make_commands();
+        return c;
+    }
+    // false if the shell failed to start, and ignores everything
+    bool ok;
 
     GameShell(const GameShell&) = delete;
 
+    // Another player may have broken up the game from another thread.
+    void check_game();
+
 public:
-    GameShell(int fd, const sockaddr *addr, socklen_t addrlen)
+    GameShell(std::string n, bool b)
+    : nick(n)
+    , binary(b)
+    , home(net::SocketSet::current())
+    , ok(chat::set_nick(nullptr, nick, this))
+    {}
+
+    GameShell(int fd, const sockaddr *addr, socklen_t addrlen, bool b)
+    : GameShell(net::sockaddr_to_string(fd, addr, addrlen), b)
     {
-        std::string nick = net::sockaddr_to_string(fd, addr, addrlen);
-        this->nick = nick;
-        if (not chat::set_nick(nullptr, nick))
+        if (not ok)
         {
             // TODO: refactor into some net class
             // TODO: offer a "last rites" message
             shutdown(fd, SHUT_RD);
         }
-        else
-            _add_commands();
     }
 
     ~GameShell()
     {
-        cmd_quit(nullptr);
-        chat::set_nick(nick, nullptr);
+        leave();
+        // (if it never got it, somebody else has it)
+        if (ok)
+            chat::set_nick(nick, nullptr);
     }
 
+    // Whether it got its nick, and is listening to the client.
+    bool started() { return ok; }
+
     void handle(const_string line) override
     {
-        cli::Shell::operator()(line);
+        if (ok)
+            commands()(this, line);
     }
 
+    void handle_frame(const_array<uint8_t> frame) override;
+    void nick_lost() override;
+
+    // For a handoff (see restore()): whether it speaks the binary
+    // protocol, the nick, the game it is in (if any, and whether it
+    // had begun), and the chat room (if any).
+    bool save(std::string *state) override;
+    // Pick up where it left off in the old process. A game that had
+    // begun is only remembered as a lobby.
+    void resume(const_string game, bool begun, const std::string *room);
+
     void writes(const_array<const_string> arr)
     {
         for (const_string s : arr)
@@ -99,32 +178,61 @@ cli::Status GameShell::cmd_nosuch(const_string argv)
     return cli::Status::NOT_FOUND;
 }
 
-cli::Status GameShell::cmd_say(const_string argv)
+void GameShell::handle_frame(const_array<uint8_t> frame)
 {
-    if (not this->_chat)
+    if (not ok or frame.empty())
+        return;
+    const_string arg(reinterpret_cast<const char *>(frame.data()) + 1,
+            frame.size() - 1);
+    switch (Op(frame.front()))
     {
-        auto room = chat::Room::get(const_string(nullptr));
-        this->_chat = make_unique<chat::Connection>(room, this->wbh);
+    case Op::SAY:
+        say(arg);
+        break;
+    case Op::NICK:
+        rename(arg);
+        break;
+    case Op::JOIN:
+        // like the text command, with no name
+        if (arg.empty())
+            arg = const_string(this->nick.data(), this->nick.size());
+        join(arg);
+        break;
+    case Op::BEGIN:
+        begin();
+        break;
+    case Op::QUIT:
+        leave();
+        break;
+    case Op::TURN:
+        end_turn();
+        break;
+    case Op::MAP:
+        map();
+        break;
+    default:
+        // a newer client, or garbage
+        this->wbh->hang_up();
+        break;
     }
+}
+
+cli::Status GameShell::cmd_say(const_string argv)
+{
     // raw command
-    this->_chat->say(this->nick, cli::trim(cli::split_first(argv).second));
+    say(cli::trim(cli::split_first(argv).second));
     return cli::Status::NORMAL;
 }
 
-cli::Status GameShell::cmd_nick(const_string argv)
+void GameShell::say(const_string text)
 {
-    const_string _ = nullptr, nick = nullptr;
-    if (not cli::extract(argv, &_, &nick))
-        return cli::Status::ARGS;
-    if (not nick)
-        return cli::Status::ERROR;
-    if (not chat::set_nick(this->nick, nick))
+    if (not this->_chat)
     {
-        this->writes({"Error: nick collision\r\n"});
-        return cli::Status::ERROR;
+        auto room = chat::Room::get(const_string(nullptr));
+        this->_chat = make_unique<chat::Connection>(room, this->wbh);
+        this->room.clear();
     }
-    this->nick = std::string(nick.begin(), nick.end());
-    return cli::Status::NORMAL;
+    this->_chat->say(this->nick, text);
 }
 
 cli::Status GameShell::cmd_help(const_string argv)
@@ -132,21 +240,23 @@ cli::Status GameShell::cmd_help(const_string argv)
     const_string _ = nullptr, cmd = nullptr;
     if (cli::extract(argv, &_, &cmd))
     {
-        auto it = this->_helps.find(std::string(cmd.begin(), cmd.end()));
-        if (it == this->_helps.end())
+        const std::string *help = commands().help(cmd);
+        if (not help)
         {
             this->writes({"no help for command: ", cmd, "\r\n"});
             return cli::Status::ERROR;
         }
-        this->writes({it->second, "\r\n"});
+        this->writes({*help, "\r\n"});
         return cli::Status::NORMAL;
     }
     if (not cli::extract(argv, &_))
         this->writes({"'help' takes 0 or 1 arguments, but whatever.\r\n"});
     this->writes({"Type 'help command' for more help.\r\n"});
     this->writes({"Command list:\r\n"});
-    for (const auto& pair : this->_helps)
-        this->writes({pair.first, "\r\n"});
+    commands().each_name([this](const std::string& name)
+            {
+                this->writes({name, "\r\n"});
+            });
     return cli::Status::NORMAL;
 }
 
@@ -159,21 +269,47 @@ cli::Status GameShell::cmd_xyzzy(const_string argv)
     return cli::Status::NORMAL;
 }
 
+cli::Status GameShell::cmd_rooms(const_string argv)
+{
+    const_string _ = nullptr;
+    if (not cli::extract(argv, &_))
+        return cli::Status::ARGS;
+    for (const chat::RoomStats& r : chat::Room::stats())
+    {
+        // the lobby is the room without a name
+        std::string line = (r.name.empty() ? "(lobby)" : r.name)
+            + ": " + std::to_string(r.chatters) + " chatting, "
+            + std::to_string(r.lines) + " lines, "
+            + std::to_string(r.bytes) + " bytes sent\r\n";
+        this->wbh->write(const_string(line));
+    }
+    return cli::Status::NORMAL;
+}
+
 // should this be merged with conquest::GalaxyGame?
 // in the real world, GameShell would not even exist ...
-class GameInstance
+class GameInstance : public std::enable_shared_from_this<GameInstance>
 {
     friend class GameShell;
-    std::string name;
+    const Interner::Id id;
+    const std::string& name;
+    // Guards everything below, and also the nick and _player
+    // of every connected shell, since those may be on other threads.
+    std::mutex lock;
     std::set<GameShell *> connections;
     std::unique_ptr<conquest::GalaxyGame> game;
+    // somebody left during the game
+    bool over;
     enum privacy_hack {privacy_ok};
+    bool is_over();
     void connect(GameShell *);
     void disconnect(GameShell *);
     void start();
+    void broadcast_locked(const_array<const_string> arr);
+    void deliver(net::SocketSet *set, net::Segment text);
 public:
     // really private
-    GameInstance(const_string name, privacy_hack);
+    GameInstance(Interner::Id id, const std::string& name, privacy_hack);
     ~GameInstance();
 
     static
@@ -182,56 +318,174 @@ public:
 };
 
 static
-std::map<std::string, std::weak_ptr<GameInstance>> games;
+std::mutex games_lock;
+static
+Interner game_names;
+// by the id of the name
+static
+std::vector<std::weak_ptr<GameInstance>> games;
 
-GameInstance::GameInstance(const_string name, privacy_hack)
-: name(name.begin(), name.end())
+GameInstance::GameInstance(Interner::Id i, const std::string& n, privacy_hack)
+: id(i)
+, name(n)
+, over()
 {}
 
 GameInstance::~GameInstance()
 {
-    games.erase(name);
+    std::lock_guard<std::mutex> guard(games_lock);
+    // another thread may already have replaced us
+    if (games[id].expired())
+        games[id].reset();
+    game_names.release(id);
 }
 
 std::shared_ptr<GameInstance> GameInstance::get(const_string name)
 {
-    std::string s(name.begin(), name.end());
-    auto it = games.find(s);
-    if (it != games.end())
-        return it->second.lock();
-    auto n = std::make_shared<GameInstance>(s, privacy_ok);
-    games.insert({s, n});
+    std::lock_guard<std::mutex> guard(games_lock);
+    Interner::Id id = game_names.intern(name);
+    if (id >= games.size())
+        games.resize(id + 1);
+    // may have expired, but its destructor is still waiting for the lock
+    auto g = games[id].lock();
+    if (g and not g->is_over())
+    {
+        // (each game holds its name, and this one already does)
+        game_names.release(id);
+        return g;
+    }
+    auto n = std::make_shared<GameInstance>(id, game_names.name(id), privacy_ok);
+    games[id] = n;
     return n;
 }
 
+bool GameInstance::is_over()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return over;
+}
+
 void GameInstance::connect(GameShell *sh)
 {
+    std::lock_guard<std::mutex> guard(lock);
     connections.insert(sh);
 }
 
 void GameInstance::broadcast(const_array<const_string> arr)
 {
+    std::lock_guard<std::mutex> guard(lock);
+    broadcast_locked(arr);
+}
+
+void GameInstance::broadcast_locked(const_array<const_string> arr)
+{
+    auto rendered = std::make_shared<std::string>();
+    for (const_string s : arr)
+        rendered->append(s.data(), s.size());
+    net::Segment text = std::move(rendered);
+    net::SocketSet *here = net::SocketSet::current();
+    std::set<net::SocketSet *> elsewhere;
+    for (GameShell *c : connections)
+    {
+        if (c->home == here)
+            c->wbh->write(text);
+        else
+            elsewhere.insert(c->home);
+    }
+    if (elsewhere.empty())
+        return;
+    // Those shells may be gone by the time it is delivered,
+    // so let their own threads look them up again.
+    std::shared_ptr<GameInstance> self = shared_from_this();
+    for (net::SocketSet *set : elsewhere)
+        set->post([self, set, text]() { self->deliver(set, text); });
+}
+
+// Called on set's own thread.
+void GameInstance::deliver(net::SocketSet *set, net::Segment text)
+{
+    std::lock_guard<std::mutex> guard(lock);
     for (GameShell *c : connections)
-        c->writes(arr);
+        if (c->home == set)
+            c->wbh->write(text);
 }
 
 void GameInstance::disconnect(GameShell *sh)
 {
-    if (connections.erase(sh) and game)
+    std::lock_guard<std::mutex> guard(lock);
+    if (connections.erase(sh) and game and not over)
     {
-        this->broadcast({"Uh-oh, somebody left during a game\r\n",});
+        this->broadcast_locked({"Uh-oh, somebody left during a game\r\n",});
         game->terminate();
-        for (GameShell *s : connections)
-            s->_game = nullptr;
+        // Everybody else is out too; since they may be on other threads,
+        // each of them leaves the next time it checks.
+        over = true;
         // (*this) has not been deleted - sh still has a reference
     }
 }
 
+void GameShell::check_game()
+{
+    if (this->_game and this->_game->is_over())
+    {
+        this->_game->disconnect(this);
+        this->_game = nullptr;
+    }
+}
+
+cli::Status GameShell::cmd_nick(const_string argv)
+{
+    const_string _ = nullptr, nick = nullptr;
+    if (not cli::extract(argv, &_, &nick))
+        return cli::Status::ARGS;
+    return rename(nick);
+}
+
+cli::Status GameShell::rename(const_string nick)
+{
+    if (not nick)
+        return cli::Status::ERROR;
+    if (not chat::set_nick(this->nick, nick, this))
+    {
+        this->writes({"Error: nick collision\r\n"});
+        return cli::Status::ERROR;
+    }
+    renamed(nick);
+    return cli::Status::NORMAL;
+}
+
+void GameShell::renamed(const_string nick)
+{
+    check_game();
+    std::unique_lock<std::mutex> guard;
+    if (this->_game)
+        // the game may be reading it
+        guard = std::unique_lock<std::mutex>(this->_game->lock);
+    this->nick = std::string(nick.begin(), nick.end());
+}
+
+void GameShell::nick_lost()
+{
+    // Somebody on another server took it at the same moment, and keeps
+    // it; this one gets a number on the end instead.
+    std::string fresh;
+    for (unsigned n = 2; ; ++n)
+    {
+        fresh = this->nick + '_' + std::to_string(n);
+        if (chat::set_nick(this->nick, fresh, this))
+            break;
+    }
+    renamed(fresh);
+    this->writes({"Your nick was also taken on another server, so now you are ",
+            fresh, "\r\n"});
+}
+
 void GameInstance::start()
 {
+    std::lock_guard<std::mutex> guard(lock);
     if (connections.size() < 2 or connections.size() > 6)
     {
-        this->broadcast({"There must be 2-6 players to start!\r\n"});
+        this->broadcast_locked({"There must be 2-6 players to start!\r\n"});
         return;
     }
     conquest::Rules rules;
@@ -248,6 +502,12 @@ void GameInstance::start()
 
 cli::Status GameShell::cmd_begin(const_string argv)
 {
+    return begin();
+}
+
+cli::Status GameShell::begin()
+{
+    check_game();
     if (not this->_game)
         return cli::Status::ERROR;
     this->_game->start();
@@ -256,6 +516,12 @@ cli::Status GameShell::cmd_begin(const_string argv)
 
 cli::Status GameShell::cmd_quit(const_string argv)
 {
+    return leave();
+}
+
+cli::Status GameShell::leave()
+{
+    check_game();
     if (not this->_game)
         return cli::Status::ERROR;
     this->_game->disconnect(this);
@@ -263,6 +529,7 @@ cli::Status GameShell::cmd_quit(const_string argv)
 
     auto room = chat::Room::get(const_string(nullptr));
     this->_chat = make_unique<chat::Connection>(room, this->wbh);
+    this->room.clear();
     return cli::Status::NORMAL;
 }
 
@@ -275,33 +542,574 @@ cli::Status GameShell::cmd_new(const_string argv)
             return cli::Status::ARGS;
         gamename = this->nick;
     }
+    join(gamename);
+    return cli::Status::NORMAL;
+}
 
+void GameShell::join(const_string gamename)
+{
+    // don't leave a dangling pointer in the old game
+    check_game();
+    if (this->_game)
+        this->_game->disconnect(this);
     this->_game = GameInstance::get(gamename);
     this->_game->connect(this);
     auto room = chat::Room::get(gamename);
     this->_chat = make_unique<chat::Connection>(room, this->wbh);
-    return cli::Status::NORMAL;
+    this->room.assign(gamename.begin(), gamename.end());
+}
+
+bool GameShell::save(std::string *state)
+{
+    if (not ok)
+        return false;
+    state->push_back(binary ? 'B' : 'T');
+    net::append_length(state, nick.size());
+    *state += nick;
+    std::string game;
+    bool begun = false;
+    if (_game)
+    {
+        std::lock_guard<std::mutex> guard(_game->lock);
+        if (not _game->over)
+        {
+            game = _game->name;
+            begun = bool(_game->game);
+        }
+    }
+    net::append_length(state, game.size());
+    *state += game;
+    state->push_back(begun ? '1' : '0');
+    state->push_back(_chat ? '1' : '0');
+    *state += room;
+    return true;
+}
+
+void GameShell::resume(const_string game, bool begun, const std::string *room)
+{
+    if (not game.empty())
+    {
+        this->_game = GameInstance::get(game);
+        this->_game->connect(this);
+        if (begun)
+            this->writes({"The server was upgraded during your game, "
+                    "so it has to begin again.\r\n"});
+    }
+    if (room)
+    {
+        this->_chat = make_unique<chat::Connection>(
+                chat::Room::get(const_string(*room)), this->wbh);
+        this->room = *room;
+    }
 }
 
 cli::Status GameShell::cmd_turn(const_string argv)
 {
+    return end_turn();
+}
+
+cli::Status GameShell::end_turn()
+{
+    // _player.controls can only be set while in a game
+    if (not _game)
+        return cli::Status::ERROR;
+    // ending the turn may start the next one, for every player
+    std::lock_guard<std::mutex> guard(_game->lock);
     if (not _player.controls)
         return cli::Status::ERROR;
     _player.controls = nullptr;
     return cli::Status::NORMAL;
 }
 
+// What a player knows of the galaxy, copied out of the game so that
+// it can be drawn without holding the lock.
+struct Chart
+{
+    conquest::PlayerID self;
+    conquest::Coord size;
+    std::map<conquest::PlayerID, std::string> names;
+    std::map<conquest::Coord, conquest::PlanetID> at;
+    // of the planets whose owner is known
+    std::map<conquest::PlanetID, conquest::PlayerID> owners;
+};
+
+static
+std::string draw(const Chart& chart)
+{
+    const size_t width = 60, height = 20;
+    if (chart.at.empty())
+        return "No planets charted yet.\r\n";
+    // what the rules said, unless it doesn't fit everything
+    conquest::Distance w = chart.size[0], h = chart.size[1];
+    for (const auto& pair : chart.at)
+    {
+        if (not (w > pair.first[0]))
+            w = pair.first[0] + 1;
+        if (not (h > pair.first[1]))
+            h = pair.first[1] + 1;
+    }
+    std::vector<std::string> grid(height, std::string(width, '.'));
+    for (const auto& pair : chart.at)
+    {
+        size_t x = std::max<conquest::Distance>(pair.first[0], 0) * width / w;
+        size_t y = std::max<conquest::Distance>(pair.first[1], 0) * height / h;
+        grid[std::min(y, height - 1)][std::min(x, width - 1)] = pair.second;
+    }
+    std::string out;
+    for (const std::string& row : grid)
+        out += row + "\r\n";
+    for (const auto& pair : chart.owners)
+    {
+        out += pair.first;
+        out += ": ";
+        auto name = chart.names.find(pair.second);
+        if (pair.second == chart.self)
+            out += "you";
+        else if (name != chart.names.end())
+            out += name->second;
+        else
+            out += "player " + std::to_string(pair.second);
+        out += "\r\n";
+    }
+    return out;
+}
+
+// Threads for the commands that are too slow for a reactor.
+static
+net::WorkerPool *workers;
+
+cli::Status GameShell::cmd_map(const_string argv)
+{
+    return map();
+}
+
+cli::Status GameShell::map()
+{
+    if (not _game)
+        return cli::Status::ERROR;
+    auto chart = std::make_shared<Chart>();
+    {
+        std::lock_guard<std::mutex> guard(_game->lock);
+        chart->self = _player.self;
+        chart->size = _player.size;
+        chart->names = _player.names;
+        chart->at = _player.chart;
+        for (const auto& pair : _player.planets)
+            if (const conquest::PlayerID *owner = pair.second.get_owner())
+                chart->owners[pair.first] = *owner;
+    }
+    // Drawing doesn't touch the game, and the connection (if it
+    // is still there) gets the map once it is done.
+    workers->submit(this->wbh, [chart]() { return draw(*chart); });
+    return cli::Status::NORMAL;
+}
+
+static
+std::chrono::seconds idle_timeout, line_timeout;
+static
+size_t max_line = 1 << 20, max_output = 4 << 20;
+// Everything but reuse_port, which listen_all() decides.
+// Replies are small and should go out right away, hence TCP_NODELAY.
+// The server speaks first, so TCP_DEFER_ACCEPT would just stall.
+static
+net::ListenOptions listen_options;
+
+static
+std::unique_ptr<net::Handler> adder(int fd, const sockaddr *addr, socklen_t addrlen)
+{
+    auto bh = make_unique<net::BufferHandler>(
+            make_unique<net::SentinelParser>(
+                make_unique<GameShell>(fd, addr, addrlen, false)),
+            fd,
+            const_string("Type 'help' for command list.\r\n"));
+    bh->set_idle_timeout(idle_timeout);
+    bh->set_line_timeout(line_timeout);
+    bh->set_input_limit(max_line);
+    // stop reading commands long before it gets that bad
+    bh->set_output_limits(max_output / 16, max_output / 4, max_output);
+    return bh;
+}
+
+static
+std::unique_ptr<net::Handler> binary_adder(int fd, const sockaddr *addr, socklen_t addrlen)
+{
+    auto bh = make_unique<net::BufferHandler>(
+            make_unique<net::FrameParser>(
+                make_unique<GameShell>(fd, addr, addrlen, true), max_line),
+            fd);
+    bh->set_idle_timeout(idle_timeout);
+    bh->set_line_timeout(line_timeout);
+    bh->set_output_limits(max_output / 16, max_output / 4, max_output);
+    return bh;
+}
+
+static
+std::unique_ptr<net::Handler> echo_adder(int fd, const sockaddr *, socklen_t)
+{
+    auto bh = make_unique<net::BufferHandler>(
+            make_unique<net::Stream>([](net::Stream& s)
+                {
+                    // leaving room for the line asking for it
+                    return echo::serve(s, max_line / 2);
+                }),
+            fd);
+    bh->set_idle_timeout(idle_timeout);
+    bh->set_line_timeout(line_timeout);
+    bh->set_input_limit(max_line);
+    bh->set_output_limits(max_output / 16, max_output / 4, max_output);
+    return bh;
+}
+
+// A connection handed over by the process this one took over from,
+// as GameShell::save() left it. Must be called on its own reactor.
+static
+std::unique_ptr<net::Handler> restore(const net::Handover& h)
+{
+    if (h.state.empty())
+        return nullptr;
+    bool binary = h.state[0] == 'B';
+    const_array<uint8_t> state = const_string(h.state);
+    state = state.cut(1).second;
+    uint64_t n;
+    if (not net::take_length(&state, &n) or n > state.size())
+        return nullptr;
+    auto parts = state.cut(n);
+    std::string nick(parts.first.begin(), parts.first.end());
+    state = parts.second;
+    if (not net::take_length(&state, &n) or n + 2 > state.size())
+        return nullptr;
+    parts = state.cut(n);
+    const_string game = parts.first;
+    bool begun = parts.second.begin()[0] == '1';
+    bool chatting = parts.second.begin()[1] == '1';
+    std::string room(parts.second.begin() + 2, parts.second.end());
+
+    auto shell = make_unique<GameShell>(nick, binary);
+    GameShell *sh = shell.get();
+    const net::Handover *from = &h;
+    net::Handover refused;
+    if (not sh->started())
+    {
+        // Somebody got the nick in the meantime. As for a new client
+        // that can't have its nick, it hears no more (but is told so).
+        refused = h;
+        if (not binary)
+            refused.output += "Your nick was taken during the server upgrade.\r\n";
+        shutdown(h.fd, SHUT_RD);
+        from = &refused;
+    }
+    std::unique_ptr<net::BufferHandler> bh;
+    if (binary)
+        bh = make_unique<net::BufferHandler>(
+                make_unique<net::FrameParser>(std::move(shell), max_line), *from);
+    else
+        bh = make_unique<net::BufferHandler>(
+                make_unique<net::SentinelParser>(std::move(shell)), *from);
+    bh->set_idle_timeout(idle_timeout);
+    bh->set_line_timeout(line_timeout);
+    if (not binary)
+        bh->set_input_limit(max_line);
+    bh->set_output_limits(max_output / 16, max_output / 4, max_output);
+    if (sh->started())
+        sh->resume(game, begun, chatting ? &room : nullptr);
+    return bh;
+}
+
+// Answers datagrams on --udp-port, for clients that only want to know
+// who is around, without connecting: "ping" gets "pong", and "who"
+// gets the nicks, a line each.
+//
+// The source address of a datagram can be forged, so no answer is much
+// longer than the question, or else this would be a way to flood
+// somebody else. To hear more nicks at once, pad "who" with spaces. If
+// they still don't all fit, the answer ends with an empty line and
+// the number to ask for next, as "who <number>", and so on.
+class Presence : public net::DatagramHandler
+{
+    void received(Peer from, const_array<uint8_t> datagram) override;
+public:
+    using DatagramHandler::DatagramHandler;
+};
+
+// small enough not to be fragmented on any sane path
+constexpr size_t PRESENCE_DATAGRAM = 1200;
+
+void Presence::received(Peer from, const_array<uint8_t> datagram)
+{
+    auto pair = cli::split_first(cli::trim(const_string(datagram)));
+    std::string what(pair.first.begin(), pair.first.end());
+    if (what == "ping")
+        send(from, const_string("pong\n"));
+    else if (what == "who")
+    {
+        size_t skip = 0;
+        if (not cli::trim(pair.second).empty()
+                and not cli::extract(pair.second, &skip))
+            return;
+        const size_t room = std::min(datagram.size(), PRESENCE_DATAGRAM);
+        const std::vector<std::string> nicks = chat::local_nicks();
+        // what saying where to go on from takes, at most
+        const size_t more = std::to_string(nicks.size()).size() + 2;
+        std::string out;
+        size_t i = std::min(skip, nicks.size());
+        for (; i < nicks.size(); ++i)
+        {
+            bool last = i + 1 == nicks.size();
+            if (out.size() + nicks[i].size() + 1 + (last ? 0 : more) > room)
+                break;
+            out += nicks[i];
+            out += '\n';
+        }
+        if (i < nicks.size())
+        {
+            out += '\n';
+            out += std::to_string(i);
+            out += '\n';
+        }
+        if (out.empty())
+            out = "\n";
+        if (out.size() <= room)
+            send(from, const_string(out));
+    }
+}
+
+typedef std::function<std::unique_ptr<net::Handler>(int, const sockaddr *, socklen_t)> Adder;
+
+// what was handed over, until it is taken
+static
+std::vector<net::Handover> handed_over;
+
+// Take over the old process's listener on the address, if it had one.
+template<class IP>
+static
+bool listen_on(net::SocketSet& set, Adder add, uint16_t port, IP iface,
+        net::ListenOptions opts)
+{
+    int fd = net::take_listener(&handed_over, port, iface);
+    if (fd != -1)
+        return set.add(make_unique<net::ListenHandler>(add, fd, opts));
+    return set.add(make_unique<net::ListenHandler>(add, port, iface, opts));
+}
+
+// Listen on every thread. Returns false if nothing worked.
+static
+bool listen_all(net::ReactorGroup& reactors, uint16_t port, Adder add)
+{
+    net::ListenOptions opts = listen_options;
+    opts.reuse_port = reactors.size() > 1;
+
+    net::SocketSet& pool = reactors[0];
+    std::cout << "try IPv6 ..." << std::endl;
+    bool v6 = listen_on(pool, add, port, net::ipv6_any, opts);
+    if (v6)
+        std::cout << "IPv6 okay" << std::endl;
+    std::cout << "try IPv4 (may fail if IPv6 succeeded) ..." << std::endl;
+    bool v4 = listen_on(pool, add, port, net::ipv4_any, opts);
+    if (v4)
+        std::cout << "IPv4 okay" << std::endl;
+
+    // the other threads listen on whatever worked for the first
+    for (size_t i = 1; i < reactors.size(); ++i)
+    {
+        if (v6 and not listen_on(reactors[i], add, port, net::ipv6_any, opts))
+            std::cerr << "Error: thread " << i << " failed to listen on IPv6\n";
+        if (v4 and not listen_on(reactors[i], add, port, net::ipv4_any, opts))
+            std::cerr << "Error: thread " << i << " failed to listen on IPv4\n";
+    }
+    // If the old process had more threads, the rest of its listeners
+    // go to the first, so that nothing waiting in them is lost.
+    int fd;
+    while ((fd = net::take_listener(&handed_over, port, net::ipv6_any)) != -1)
+        v6 = pool.add(make_unique<net::ListenHandler>(add, fd, opts)) or v6;
+    while ((fd = net::take_listener(&handed_over, port, net::ipv4_any)) != -1)
+        v4 = pool.add(make_unique<net::ListenHandler>(add, fd, opts)) or v4;
+    return v6 or v4;
+}
+
+// Listen on just the one address, on every thread. Returns false if
+// the first thread couldn't.
+template<class IP>
+static
+bool listen_each(net::ReactorGroup& reactors, uint16_t port, IP iface, Adder add)
+{
+    net::ListenOptions opts = listen_options;
+    opts.reuse_port = reactors.size() > 1;
+    if (not listen_on(reactors[0], add, port, iface, opts))
+        return false;
+    for (size_t i = 1; i < reactors.size(); ++i)
+        if (not listen_on(reactors[i], add, port, iface, opts))
+            std::cerr << "Error: thread " << i << " failed to listen\n";
+    // (as for listen_all)
+    int fd;
+    while ((fd = net::take_listener(&handed_over, port, iface)) != -1)
+        reactors[0].add(make_unique<net::ListenHandler>(add, fd, opts));
+    return true;
+}
+
+// Listen for the links of other servers on the address, or if there
+// is none, only on loopback. Returns false if nothing worked.
+static
+bool listen_peers(net::ReactorGroup& reactors, uint16_t port, const std::string& host)
+{
+    if (host.empty())
+    {
+        bool v6 = listen_each(reactors, port, net::ipv6_loopback, chat::Federation::accept);
+        bool v4 = listen_each(reactors, port, net::ipv4_loopback, chat::Federation::accept);
+        return v6 or v4;
+    }
+    net::IPv4 v4;
+    net::IPv6 v6;
+    if (inet_pton(AF_INET, host.c_str(), v4.data) == 1)
+        return listen_each(reactors, port, v4, chat::Federation::accept);
+    if (inet_pton(AF_INET6, host.c_str(), v6.data) == 1)
+        return listen_each(reactors, port, v6, chat::Federation::accept);
+    return false;
+}
+
+// Answer datagrams on every thread. Returns false if nothing worked.
+static
+bool listen_udp(net::ReactorGroup& reactors, uint16_t port)
+{
+    net::DatagramOptions opts;
+    opts.reuse_port = reactors.size() > 1;
+    opts.max_output = max_output;
+    opts.segment = true;
+    opts.busy_poll = listen_options.busy_poll;
+    // plenty for anybody just asking who is around
+    opts.source_rate = 10;
+    opts.source_burst = 20;
+    bool v6 = false, v4 = false;
+    for (size_t i = 0; i < reactors.size(); ++i)
+    {
+        auto p6 = make_unique<Presence>(port, net::ipv6_any, opts);
+        auto p4 = make_unique<Presence>(port, net::ipv4_any, opts);
+        p6->set_peer_timeout(std::chrono::minutes(1));
+        p4->set_peer_timeout(std::chrono::minutes(1));
+        // (IPv4 may fail if IPv6 succeeded)
+        v6 = reactors[i].add(std::move(p6)) or v6;
+        v4 = reactors[i].add(std::move(p4)) or v4;
+    }
+    return v6 or v4;
+}
+
+// Listen in the first thread, replacing a socket left behind by an
+// earlier run (but not clobbering anything else).
+static
+bool listen_unix(net::ReactorGroup& reactors, const std::string& path, Adder add)
+{
+    int fd = net::take_listener(&handed_over, path);
+    if (fd != -1)
+        return reactors[0].add(make_unique<net::ListenHandler>(add, fd, listen_options));
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 and S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+    return reactors[0].add(make_unique<net::ListenHandler>(add, path.c_str(), listen_options));
+}
+
+static
+bool extract_seconds(int& i, int argc, char **argv, std::chrono::seconds *out)
+{
+    unsigned secs;
+    if (++i == argc or not cli::extract(argv[i], &secs))
+        return false;
+    *out = std::chrono::seconds(secs);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     uint16_t port = 0;
+    uint16_t binary_port = 0;
+    uint16_t echo_port = 0;
+    std::string unix_path;
+    unsigned threads = 1;
+    unsigned worker_threads = 2;
+    net::Backend backend = net::Backend::EPOLL;
+    std::chrono::seconds stats_interval(0);
+    std::string node;
+    uint16_t peer_port = 0;
+    std::string peer_host;
+    std::string peer_secret;
+    std::string peer_unix;
+    std::vector<std::string> peers;
+    std::string upgrade_path;
+    uint16_t udp_port = 0;
+    int busy_poll = 0;
+    int first_cpu = -1;
+    listen_options.nodelay = true;
+    listen_options.accept_budget = 64;
     for (int i = 1; i < argc; ++i)
     {
         std::string arg = argv[i];
         if (arg == "--help")
         {
-            std::cout << "Usage: ./main --port <number>\n";
+            std::cout << "Usage: ./main --port <number> [--threads <number>]\n";
             std::cout << "Port number must be between 1 and 65535,\n";
             std::cout << "and you must have appropriate permissions.\n";
+            std::cout << "With more than 1 thread, each thread accepts\n";
+            std::cout << "its own connections (using SO_REUSEPORT).\n";
+            std::cout << '\n';
+            std::cout << "  --idle-timeout <seconds>\n";
+            std::cout << "    disconnect clients that send nothing for this long\n";
+            std::cout << "  --line-timeout <seconds>\n";
+            std::cout << "    disconnect clients that take this long to finish a line\n";
+            std::cout << "  --max-line <bytes>\n";
+            std::cout << "    disconnect clients that send longer lines (default 1M)\n";
+            std::cout << "  --max-output <bytes>\n";
+            std::cout << "    disconnect clients that fall this far behind (default 4M)\n";
+            std::cout << "  --unix <path>\n";
+            std::cout << "    also listen on a unix socket (in the first thread)\n";
+            std::cout << "  --binary-port <number>\n";
+            std::cout << "    also listen for programs speaking the binary protocol\n";
+            std::cout << "    (length-prefixed frames, see 'enum class Op')\n";
+            std::cout << "  --echo-port <number>\n";
+            std::cout << "    also listen for clients that want things echoed,\n";
+            std::cout << "    to test them against (see echo.hpp)\n";
+            std::cout << "  --udp-port <number>\n";
+            std::cout << "    also answer datagrams: \"ping\", and \"who\" is here\n";
+            std::cout << "    (a few a second from each address)\n";
+            std::cout << "  --accept-budget <number>\n";
+            std::cout << "    accept at most this many connections per wakeup,\n";
+            std::cout << "    so a storm of them can't starve everyone else\n";
+            std::cout << "    (default 64, 0 means no limit)\n";
+            std::cout << "  --accept-rate <number>\n";
+            std::cout << "    accept at most this many connections per second\n";
+            std::cout << "    per thread, in bursts of up to as many\n";
+            std::cout << "  --fast-open <number>\n";
+            std::cout << "    allow TCP Fast Open, with this long a queue\n";
+            std::cout << "  --peer <address>\n";
+            std::cout << "    link to another server (IPv4:port, [IPv6]:port,\n";
+            std::cout << "    or a unix path with a '/'), sharing rooms and nicks;\n";
+            std::cout << "    every server must link to every other\n";
+            std::cout << "  --peer-port <number>\n";
+            std::cout << "  --peer-unix <path>\n";
+            std::cout << "    listen for the links of other servers\n";
+            std::cout << "  --peer-host <address>\n";
+            std::cout << "    the (IPv4 or IPv6) address for --peer-port\n";
+            std::cout << "    (default loopback)\n";
+            std::cout << "  --peer-secret <path>\n";
+            std::cout << "    a file whose first line every server must share,\n";
+            std::cout << "    to be linked to; required with --peer-port\n";
+            std::cout << "  --node <name>\n";
+            std::cout << "    the name of this server, for its links\n";
+            std::cout << "    (default host:pid)\n";
+            std::cout << "  --workers <number>\n";
+            std::cout << "    threads for slow commands like 'map', so that\n";
+            std::cout << "    they don't hold up everyone else (default 2)\n";
+            std::cout << "  --upgrade <path>\n";
+            std::cout << "    take over the listeners and clients of the server\n";
+            std::cout << "    listening on this unix socket (if any), then listen\n";
+            std::cout << "    on it for the next one to take over (epoll only)\n";
+            std::cout << "  --stats <seconds>\n";
+            std::cout << "    print what each thread has been doing this often\n";
+            std::cout << "  --busy-poll <microseconds>\n";
+            std::cout << "    keep checking for events this long before sleeping,\n";
+            std::cout << "    for less latency at the cost of a busy CPU per thread\n";
+            std::cout << "  --pin-cpu <number>\n";
+            std::cout << "    run thread i on CPU number+i, and nowhere else\n";
+            std::cout << "  --backend epoll|uring\n";
+            std::cout << "    how to wait for events (uring falls back to epoll\n";
+            std::cout << "    if the kernel is too old)\n";
             std::cout << '\n';
             std::cout << "Then use an external client to connect.\n";
             std::cout << "e.g.: netcat <IP of localhost> <port>\n";
@@ -321,6 +1129,215 @@ int main(int argc, char **argv)
             std::cerr << "Error: --port argument not integer in range\n";
             return 1;
         }
+        if (arg == "--unix")
+        {
+            if (++i != argc and *argv[i])
+            {
+                unix_path = argv[i];
+                continue;
+            }
+            std::cerr << "Error: --unix needs a path\n";
+            return 1;
+        }
+        if (arg == "--binary-port")
+        {
+            if (++i != argc and cli::extract(argv[i], &binary_port) and binary_port)
+                continue;
+            std::cerr << "Error: --binary-port argument not integer in range\n";
+            return 1;
+        }
+        if (arg == "--echo-port")
+        {
+            if (++i != argc and cli::extract(argv[i], &echo_port) and echo_port)
+                continue;
+            std::cerr << "Error: --echo-port argument not integer in range\n";
+            return 1;
+        }
+        if (arg == "--udp-port")
+        {
+            if (++i != argc and cli::extract(argv[i], &udp_port) and udp_port)
+                continue;
+            std::cerr << "Error: --udp-port argument not integer in range\n";
+            return 1;
+        }
+        if (arg == "--threads")
+        {
+            if (++i == argc)
+            {
+                std::cerr << "Error: threads argument not given\n";
+                return 1;
+            }
+            if (cli::extract(argv[i], &threads) and threads)
+                continue;
+            std::cerr << "Error: --threads argument not positive integer\n";
+            return 1;
+        }
+        if (arg == "--backend")
+        {
+            if (++i == argc)
+            {
+                std::cerr << "Error: backend argument not given\n";
+                return 1;
+            }
+            std::string b = argv[i];
+            if (b == "epoll")
+                backend = net::Backend::EPOLL;
+            else if (b == "uring")
+                backend = net::Backend::URING;
+            else
+            {
+                std::cerr << "Error: --backend must be epoll or uring\n";
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--idle-timeout")
+        {
+            if (extract_seconds(i, argc, argv, &idle_timeout))
+                continue;
+            std::cerr << "Error: --idle-timeout needs a number of seconds\n";
+            return 1;
+        }
+        if (arg == "--line-timeout")
+        {
+            if (extract_seconds(i, argc, argv, &line_timeout))
+                continue;
+            std::cerr << "Error: --line-timeout needs a number of seconds\n";
+            return 1;
+        }
+        if (arg == "--workers")
+        {
+            if (++i != argc and cli::extract(argv[i], &worker_threads) and worker_threads)
+                continue;
+            std::cerr << "Error: --workers needs a positive number\n";
+            return 1;
+        }
+        if (arg == "--upgrade")
+        {
+            if (++i != argc and (upgrade_path = argv[i], not upgrade_path.empty()))
+                continue;
+            std::cerr << "Error: --upgrade needs a path\n";
+            return 1;
+        }
+        if (arg == "--stats")
+        {
+            if (extract_seconds(i, argc, argv, &stats_interval))
+                continue;
+            std::cerr << "Error: --stats needs a number of seconds\n";
+            return 1;
+        }
+        if (arg == "--peer")
+        {
+            if (++i != argc and *argv[i])
+            {
+                peers.push_back(argv[i]);
+                continue;
+            }
+            std::cerr << "Error: --peer needs an address\n";
+            return 1;
+        }
+        if (arg == "--peer-port")
+        {
+            if (++i != argc and cli::extract(argv[i], &peer_port) and peer_port)
+                continue;
+            std::cerr << "Error: --peer-port argument not integer in range\n";
+            return 1;
+        }
+        if (arg == "--peer-host")
+        {
+            char buf[sizeof(in6_addr)];
+            if (++i != argc and (inet_pton(AF_INET, argv[i], buf) == 1
+                        or inet_pton(AF_INET6, argv[i], buf) == 1))
+            {
+                peer_host = argv[i];
+                continue;
+            }
+            std::cerr << "Error: --peer-host needs an IPv4 or IPv6 address\n";
+            return 1;
+        }
+        if (arg == "--peer-secret")
+        {
+            if (++i != argc)
+            {
+                std::ifstream in(argv[i]);
+                if (std::getline(in, peer_secret) and not peer_secret.empty())
+                    continue;
+            }
+            std::cerr << "Error: --peer-secret needs a file, starting with the secret\n";
+            return 1;
+        }
+        if (arg == "--peer-unix")
+        {
+            if (++i != argc and *argv[i])
+            {
+                peer_unix = argv[i];
+                continue;
+            }
+            std::cerr << "Error: --peer-unix needs a path\n";
+            return 1;
+        }
+        if (arg == "--node")
+        {
+            if (++i != argc and *argv[i])
+            {
+                node = argv[i];
+                continue;
+            }
+            std::cerr << "Error: --node needs a name\n";
+            return 1;
+        }
+        if (arg == "--accept-budget")
+        {
+            if (++i != argc and cli::extract(argv[i], &listen_options.accept_budget))
+                continue;
+            std::cerr << "Error: --accept-budget needs a number\n";
+            return 1;
+        }
+        if (arg == "--accept-rate")
+        {
+            if (++i != argc and cli::extract(argv[i], &listen_options.accept_rate))
+            {
+                listen_options.accept_burst = listen_options.accept_rate;
+                continue;
+            }
+            std::cerr << "Error: --accept-rate needs a number\n";
+            return 1;
+        }
+        if (arg == "--fast-open")
+        {
+            if (++i != argc and cli::extract(argv[i], &listen_options.fast_open))
+                continue;
+            std::cerr << "Error: --fast-open needs a number\n";
+            return 1;
+        }
+        if (arg == "--busy-poll")
+        {
+            if (++i != argc and cli::extract(argv[i], &busy_poll) and busy_poll >= 0)
+                continue;
+            std::cerr << "Error: --busy-poll needs a number of microseconds\n";
+            return 1;
+        }
+        if (arg == "--pin-cpu")
+        {
+            if (++i != argc and cli::extract(argv[i], &first_cpu) and first_cpu >= 0)
+                continue;
+            std::cerr << "Error: --pin-cpu needs a CPU number\n";
+            return 1;
+        }
+        if (arg == "--max-line")
+        {
+            if (++i != argc and cli::extract(argv[i], &max_line))
+                continue;
+            std::cerr << "Error: --max-line needs a number of bytes\n";
+            return 1;
+        }
+        if (arg == "--max-output")
+        {
+            if (++i != argc and cli::extract(argv[i], &max_output))
+                continue;
+            std::cerr << "Error: --max-output needs a number of bytes\n";
+            return 1;
+        }
         std::cerr << "Error: unknown argument: " << arg << '\n';
     }
     if (port == 0)
@@ -328,23 +1345,114 @@ int main(int argc, char **argv)
         std::cerr << "Error: --port not specified, try --help\n";
         return 1;
     }
-    net::SocketSet pool;
-    auto adder =
-            [](int fd, const sockaddr *addr, socklen_t addrlen)
+    if (peer_port and peer_secret.empty())
+    {
+        std::cerr << "Error: --peer-port needs --peer-secret\n";
+        return 1;
+    }
+    // A peer that goes away is noticed by write() failing with EPIPE,
+    // rather than by the whole process being killed.
+    signal(SIGPIPE, SIG_IGN);
+
+    // every client is a file descriptor
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 and files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    // must outlive the reactors, which hold its links
+    std::unique_ptr<chat::Federation> federation;
+    net::ReactorGroup reactors(threads, backend);
+    // Gone before the reactors, so what is left of its jobs can still
+    // be posted to them (and just go unrun).
+    net::WorkerPool worker_pool(worker_threads);
+    workers = &worker_pool;
+    if (not upgrade_path.empty())
+    {
+        if (not net::receive_handoff(upgrade_path, &handed_over))
+        {
+            std::cerr << "Error: failed to take over from the old server\n";
+            return 1;
+        }
+        if (not handed_over.empty())
+            std::cout << "took over " << handed_over.size() << " sockets" << std::endl;
+    }
+    // before anything is polling, so this thread may touch them all
+    for (size_t i = 0; i < reactors.size(); ++i)
+    {
+        reactors[i].set_stats_interval(stats_interval);
+        reactors[i].set_busy_poll(std::chrono::microseconds(busy_poll));
+    }
+    reactors.pin(first_cpu);
+    listen_options.busy_poll = busy_poll;
+    listen_all(reactors, port, adder);
+    if (binary_port and not listen_all(reactors, binary_port, binary_adder))
+        std::cerr << "Error: failed to listen on the binary port\n";
+    if (echo_port and not listen_all(reactors, echo_port, echo_adder))
+        std::cerr << "Error: failed to listen on the echo port\n";
+    if (udp_port and not listen_udp(reactors, udp_port))
+        std::cerr << "Error: failed to listen on the UDP port\n";
+    if (not unix_path.empty() and not listen_unix(reactors, unix_path, adder))
+        std::cerr << "Error: failed to listen on " << unix_path << '\n';
+
+    if (not peers.empty() or peer_port or not peer_unix.empty())
+    {
+        if (node.empty())
+        {
+            char host[256] = {};
+            gethostname(host, sizeof(host) - 1);
+            node = std::string(host) + ":" + std::to_string(getpid());
+        }
+        federation = make_unique<chat::Federation>(node, peer_secret, &reactors[0]);
+        for (const std::string& peer : peers)
+        {
+            sockaddr_storage addr;
+            socklen_t addr_len;
+            if (not net::string_to_sockaddr(peer, &addr, &addr_len))
             {
-                return make_unique<net::BufferHandler>(
-                        make_unique<net::SentinelParser>(
-                            make_unique<GameShell>(fd, addr, addrlen)),
-                        fd,
-                        const_string("Type 'help' for command list.\r\n"));
-            };
-    std::cout << "try IPv6 ..." << std::endl;
-    if (pool.add(make_unique<net::ListenHandler>(adder, port, net::ipv6_any)))
-        std::cout << "IPv6 okay" << std::endl;
-    std::cout << "try IPv4 (may fail if IPv6 succeeded) ..." << std::endl;
-    if (pool.add(make_unique<net::ListenHandler>(adder, port, net::ipv4_any)))
-        std::cout << "IPv4 okay" << std::endl;
+                std::cerr << "Error: bad address for --peer: " << peer << '\n';
+                return 1;
+            }
+            federation->add_peer(reinterpret_cast<sockaddr *>(&addr), addr_len);
+        }
+        chat::federation = federation.get();
+        if (peer_port and not listen_peers(reactors, peer_port, peer_host))
+            std::cerr << "Error: failed to listen on the peer port\n";
+        if (not peer_unix.empty()
+                and not listen_unix(reactors, peer_unix, chat::Federation::accept))
+            std::cerr << "Error: failed to listen on " << peer_unix << '\n';
+        federation->start();
+    }
+
+    if (not upgrade_path.empty() and not listen_unix(reactors, upgrade_path,
+                [&reactors](int fd, const sockaddr *, socklen_t)
+                {
+                    return net::offer_handoff(&reactors, fd);
+                }))
+        std::cerr << "Error: failed to listen on " << upgrade_path << '\n';
+    // The connections are spread over the threads, which rebuild them.
+    size_t next = 0;
+    for (net::Handover& h : handed_over)
+    {
+        if (h.listening)
+        {
+            // for something that isn't listened on any more
+            close(h.fd);
+            continue;
+        }
+        net::SocketSet *set = &reactors[next++ % reactors.size()];
+        set->post([set, h]()
+                {
+                    std::unique_ptr<net::Handler> handler = restore(h);
+                    if (not handler)
+                        close(h.fd);
+                    else
+                        set->add(std::move(handler));
+                });
+    }
+    handed_over.clear();
 
-    while (pool)
-        pool.poll();
+    reactors.run();
 }
@@ -5,10 +5,15 @@
 
 # include <memory>
 
+#if __cplusplus >= 201402L
+// otherwise the two are ambiguous, by argument-dependent lookup
+using std::make_unique;
+#else
 template<class T, class... A>
 std::unique_ptr<T> make_unique(A&&... a)
 {
     return std::unique_ptr<T>(new T(std::forward<A>(a)...));
 }
+#endif
 
 #endif // MAKE_UNIQUE_HPP
@@ -1,30 +1,56 @@
 // Copyright 2012 Ben Longbons
 // GPL3+
 #include "net.hpp"
+#include "scan.hpp"
+#include "uring.hpp"
 
 #include <cerrno>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 #include <sstream>
+#include <thread>
+#include <typeinfo>
 
 static_assert(EAGAIN == EWOULDBLOCK, "you have crazy errno values ...");
 
+// not in older headers (<linux/eventpoll.h>, since 6.9)
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+# define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+# define SO_PREFER_BUSY_POLL 69
+#endif
+
 namespace net
 {
 
-std::string sockaddr_to_string(int fd, const sockaddr *addr, socklen_t)
+std::string sockaddr_to_string(int fd, const sockaddr *addr, socklen_t addr_len)
 {
     switch(addr->sa_family)
     {
@@ -44,8 +70,13 @@ std::string sockaddr_to_string(int fd, const sockaddr *addr, socklen_t)
     }
     case AF_UNIX:
     {
+        // A client usually doesn't bother to bind a name,
+        // so that all of them would be called "".
         auto addru = reinterpret_cast<const sockaddr_un *>(addr);
-        return addru->sun_path;
+        size_t max = addr_len - offsetof(sockaddr_un, sun_path);
+        if (addr_len > offsetof(sockaddr_un, sun_path) and addru->sun_path[0])
+            return std::string(addru->sun_path, strnlen(addru->sun_path, max));
+        break;
     }
     }
     std::ostringstream o;
@@ -53,30 +84,107 @@ std::string sockaddr_to_string(int fd, const sockaddr *addr, socklen_t)
     return o.str();
 }
 
+bool string_to_sockaddr(const_string s, sockaddr_storage *addr, socklen_t *addr_len)
+{
+    std::string str(s.begin(), s.end());
+    *addr = sockaddr_storage();
+    if (str.find('/') != std::string::npos)
+    {
+        auto addru = reinterpret_cast<sockaddr_un *>(addr);
+        if (str.size() >= sizeof(addru->sun_path))
+            return false;
+        addru->sun_family = AF_UNIX;
+        memcpy(addru->sun_path, str.data(), str.size());
+        *addr_len = sizeof(sockaddr_un);
+        return true;
+    }
+    size_t colon = str.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string host = str.substr(0, colon);
+    const char *digits = str.c_str() + colon + 1;
+    char *end;
+    unsigned long port = strtoul(digits, &end, 10);
+    if (*digits < '0' or *digits > '9' or *end or not port or port > 0xffff)
+        return false;
+    if (host.size() >= 2 and host.front() == '[' and host.back() == ']')
+    {
+        auto addr6 = reinterpret_cast<sockaddr_in6 *>(addr);
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        *addr_len = sizeof(sockaddr_in6);
+        host = host.substr(1, host.size() - 2);
+        return inet_pton(AF_INET6, host.c_str(), &addr6->sin6_addr) == 1;
+    }
+    auto addr4 = reinterpret_cast<sockaddr_in *>(addr);
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(port);
+    *addr_len = sizeof(sockaddr_in);
+    return inet_pton(AF_INET, host.c_str(), &addr4->sin_addr) == 1;
+}
+
 epoll_event Handler::create_event()
 {
     epoll_event event {};
-    if (this->read)
+    if (this->reading())
         event.events |= EPOLLIN | EPOLLRDHUP;
     if (this->write)
         event.events |= EPOLLOUT;
     // I don't understand exactly what the following does
     // so I'll set them and see what happens
     event.events |= EPOLLPRI;
-    // the following is safe only if all handlers loop until EAGAIN
-    // AND you never check writing when it's not needed
-    // TODO enable this
-    //event.events |= EPOLLET;
-    event.data.fd = this->fd;
+    // this is safe only because such handlers loop until EAGAIN,
+    // and write is still only enabled while there is something to write
+    if (this->edge)
+        event.events |= EPOLLET;
+    event.data.u64 = this->key();
     return event;
 }
 
+uint64_t Handler::key()
+{
+    return uint64_t(this->generation) << 32 | uint32_t(this->fd);
+}
+
+HandlerRef Handler::ref()
+{
+    return HandlerRef(set, key());
+}
+
+void HandlerRef::post(std::function<void(Handler *)> f) const
+{
+    SocketSet *s = set;
+    uint64_t k = key;
+    s->post([s, k, f]()
+            {
+                if (Handler *h = s->find(k))
+                    f(h);
+            });
+}
+
 void Handler::enable_write()
 {
     assert(this->read);
-    this->write = true;
-    epoll_event event = this->create_event();
-    epoll_ctl(set->epfd, EPOLL_CTL_MOD, this->fd, &event);
+    if (set)
+        set->want_write(this);
+    else
+        this->write = true;
+}
+
+LoopStats *Handler::stats()
+{
+    if (set and __builtin_expect(set->stats.enabled, false))
+        return &set->stats;
+    return nullptr;
+}
+
+void Handler::pause_reading(bool pause)
+{
+    if (this->paused == pause)
+        return;
+    this->paused = pause;
+    if (set and this->read)
+        set->rewatch(this);
 }
 
 #if 0
@@ -98,40 +206,124 @@ void Handler::replace(std::unique_ptr<Handler> h)
 
 bool Handler::add_peer(std::unique_ptr<Handler> h)
 {
+    if (h)
+        h->sole_owner = true;
     return set->add(std::move(h));
 }
 
+void Handler::schedule(Timer& t, std::chrono::milliseconds delay)
+{
+    if (set)
+        set->timers.schedule(t, delay);
+}
+
+void Handler::cancel(Timer& t)
+{
+    if (set)
+        set->timers.cancel(t);
+}
+
+std::chrono::milliseconds Handler::now()
+{
+    return set ? set->timers.elapsed() : std::chrono::milliseconds::zero();
+}
+
+void Handler::drop()
+{
+    if (set)
+        set->remove(this);
+}
+
 Handler::~Handler()
 {
     if (fd != -1)
         close(fd);
 }
 
-SocketSet::SocketSet()
-: epfd(epoll_create1(0))
+// Not a possible Handler::key(), since fd would be -1.
+constexpr uint64_t MAILBOX_KEY = ~uint64_t(0);
+
+static thread_local
+SocketSet *current_set = nullptr;
+
+SocketSet::SocketSet(Backend backend)
+: epfd(-1)
+, uring()
+, wiped_uring()
+, timers()
+, stats()
+, stats_interval()
+, stats_timer([this]() { this->report_stats(); })
+, busy_poll()
 , sockets()
+, live()
+, next_generation()
+, graveyard()
+, dirty()
+, wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+, mailbox_lock()
+, mailbox()
 {
-    if (epfd == -1)
-        // default ctor of std::map does no allocation
-        fprintf(stderr, "Failed to create epoll instance: %m\n");
+    if (backend == Backend::URING)
+    {
+        uring = Uring::create(this);
+        if (not uring)
+            fprintf(stderr, "io_uring not usable, falling back to epoll\n");
+    }
+    if (not uring)
+    {
+        epfd = epoll_create1(0);
+        if (epfd == -1)
+            // default ctor of std::vector does no allocation
+            fprintf(stderr, "Failed to create epoll instance: %m\n");
+    }
+    if (wakefd == -1)
+    {
+        fprintf(stderr, "Failed to create eventfd: %m\n");
+        wipe();
+        return;
+    }
+    // The mailbox is not a Handler, since it should not keep
+    // the set alive by itself.
+    if (uring)
+    {
+        if (not uring->watch_mailbox(wakefd))
+            wipe();
+        return;
+    }
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.u64 = MAILBOX_KEY;
+    if (epfd != -1 and epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &event) == -1)
+    {
+        fprintf(stderr, "Failed to add eventfd to epoll: %m\n");
+        wipe();
+    }
 }
 
 SocketSet::~SocketSet()
 {
+    // handlers first, while the backend can still be told about them
+    sockets.clear();
+    graveyard.clear();
+    uring.reset();
+    wiped_uring.reset();
     if (epfd != -1)
         close(epfd);
+    if (wakefd != -1)
+        close(wakefd);
 }
 
 SocketSet::operator bool() const
 {
     // instead guarantee that if epfd == -1, sockets is always empty
-    // return epfd != -1 and !sockets.empty();
-    return not sockets.empty();
+    // return epfd != -1 and live;
+    return live;
 }
 
 bool SocketSet::add(std::unique_ptr<net::Handler> sock)
 {
-    if (epfd == -1)
+    if (epfd == -1 and not uring)
         return false;
     if (!sock)
         return false;
@@ -140,48 +332,188 @@ bool SocketSet::add(std::unique_ptr<net::Handler> sock)
     bool write = sock->write;
     if (fd == -1 or not (read or write))
         return false;
+    if (size_t(fd) < sockets.size() and sockets[fd])
+    {
+        // replacing it would close the fd out from under both
+        fprintf(stderr, "fd %d is already in the set\n", fd);
+        return false;
+    }
 
-    epoll_event event = sock->create_event();
+    sock->generation = next_generation++ & 0x1fffffff;
+    if (not watch(sock.get()))
+        return false;
+    sock->set = this;
+    if (size_t(fd) >= sockets.size())
+        sockets.resize(fd + 1);
+    Handler *h = sock.get();
+    sockets[fd] = std::move(sock);
+    ++live;
+    h->on_added();
+    return true;
+}
 
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+bool SocketSet::watch(Handler *h)
+{
+    if (uring)
+        return uring->watch(h);
+    epoll_event event = h->create_event();
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, h->fd, &event) == -1)
     {
         fprintf(stderr, "Failed to add to epoll: %m\n");
         return false;
     }
-    sock->set = this;
-    // TODO: ensure that fd was not already in the set - it will be closed!
-    sockets[fd] = std::move(sock);
+    h->watched = event.events;
     return true;
 }
 
+bool SocketSet::rewatch(Handler *h)
+{
+    if (uring)
+        return uring->rewatch(h);
+    epoll_event event = h->create_event();
+    // Most callers don't know whether anything actually changed,
+    // e.g. a write that finished in the same batch it was enabled.
+    if (event.events == h->watched)
+        return true;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &event) == -1)
+    {
+        fprintf(stderr, "epoll_ctl mod failed: %m\n");
+        return false;
+    }
+    h->watched = event.events;
+    return true;
+}
+
+void SocketSet::want_write(Handler *h)
+{
+    // io_uring already batches the sends into one submission
+    if (uring or not h->eager)
+    {
+        h->write = true;
+        rewatch(h);
+        return;
+    }
+    if (h->write or h->flushing)
+        return;
+    h->flushing = true;
+    dirty.push_back(h->key());
+}
+
+void SocketSet::flush()
+{
+    // Note: a write may resume reading, and so enable more writes.
+    for (size_t i = 0; i < dirty.size(); ++i)
+    {
+        const int fd = int(uint32_t(dirty[i]));
+        const uint32_t generation = dirty[i] >> 32;
+        Handler *p = size_t(fd) < sockets.size() ? sockets[fd].get() : nullptr;
+        if (not p or p->generation != generation)
+            // dropped since
+            continue;
+        p->flushing = false;
+        bool more = writable(p) == Handler::Status::KEEP;
+        if (sockets[fd].get() != p)
+            continue;
+        if (more)
+        {
+            // only now is it worth waiting for EPOLLOUT
+            p->write = true;
+            if (not rewatch(p))
+            {
+                wipe();
+                return;
+            }
+        }
+        else if (not (p->read or p->write))
+            // its last words went out
+            retire(p);
+    }
+    dirty.clear();
+}
+
+bool SocketSet::unwatch(Handler *h)
+{
+    if (uring)
+    {
+        uring->unwatch(h);
+        return true;
+    }
+    // The handler is about to be destroyed (at the latest, at the end
+    // of this poll()), and the close() will take it out of the epoll
+    // for free. Events that arrive meanwhile fail the generation check.
+    if (h->sole_owner)
+        return true;
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, nullptr) == -1)
+    {
+        fprintf(stderr, "epoll_ctl del failed: %m\n");
+        return false;
+    }
+    return true;
+}
+
+void SocketSet::retire(Handler *h)
+{
+    int fd = h->fd;
+    if (not unwatch(h))
+    {
+        wipe();
+        return;
+    }
+    sockets[fd].reset();
+    --live;
+}
+
+void SocketSet::remove(Handler *h)
+{
+    int fd = h->fd;
+    unwatch(h);
+    graveyard.push_back(std::move(sockets[fd]));
+    --live;
+    // so that it can't do anything to the set in its last moments
+    // (and dropping it again does nothing)
+    h->set = nullptr;
+}
+
 void SocketSet::wipe()
 {
-    close(epfd);
+    if (epfd != -1)
+        close(epfd);
     epfd = -1;
     sockets.clear();
+    graveyard.clear();
+    dirty.clear();
+    if (uring)
+        wiped_uring = std::move(uring);
+    live = 0;
 }
 
 void SocketSet::handle_event(epoll_event event)
 {
     bool modify = false;
 
-    const int fd = event.data.fd;
-    const auto it = sockets.find(fd);
-    if (it == sockets.end())
+    if (event.data.u64 == MAILBOX_KEY)
     {
-        fprintf(stderr, "epoll event fd not found: %d\n", fd);
-        wipe();
+        handle_mailbox();
         return;
     }
 
-    Handler *p = it->second.get();
+    const int fd = int(uint32_t(event.data.u64));
+    const uint32_t generation = event.data.u64 >> 32;
+    // Note: sockets may be resized by the callbacks, so don't keep
+    // a reference into it.
+    Handler *p = size_t(fd) < sockets.size() ? sockets[fd].get() : nullptr;
+    if (not p or p->generation != generation)
+        // The handler was removed earlier in this batch of events,
+        // and its fd may even have been reused since.
+        return;
+
     if (event.events & EPOLLIN)
     {
         // for record of unknowns
         event.events &= ~EPOLLIN;
         // Note: p->on_readable() may flip q->write for any q in
         // set, including p. The code below is just fine with that.
-        if (p->on_readable() == Handler::Status::DROP)
+        if (readable(p) == Handler::Status::DROP)
         {
             modify = true;
             p->read = false;
@@ -191,7 +523,7 @@ void SocketSet::handle_event(epoll_event event)
     if (event.events & EPOLLOUT)
     {
         event.events &= ~EPOLLOUT;
-        if (p->on_writable() == Handler::Status::DROP)
+        if (writable(p) == Handler::Status::DROP)
         {
             // note: this is normal, when a write completes.
             modify = true;
@@ -214,11 +546,12 @@ void SocketSet::handle_event(epoll_event event)
 
     if (event.events & EPOLLERR)
     {
-        // I'm not sure when this happens
+        // e.g. the peer reset the connection, which is only its
+        // problem (a read or write will have failed already, or soon)
         event.events &= ~EPOLLERR;
-        fprintf(stderr, "fd %d error\n", fd);
-        wipe();
-        return;
+        modify = true;
+        p->read = false;
+        p->write = false;
     }
 
     if (event.events & EPOLLHUP)
@@ -235,42 +568,184 @@ void SocketSet::handle_event(epoll_event event)
     if (event.events)
         fprintf(stderr, "epoll got unknown: %x", event.events);
 
+    // A callback may have dropped it already.
+    if (sockets[fd].get() != p)
+        return;
+
     if (not modify)
         return;
 
     // Note: p->write may have been enabled by the read callback.
-    // In this case, it will have called epoll_ctl itself.
-    int op = (p->read or p->write)
-        ? EPOLL_CTL_MOD
-        : EPOLL_CTL_DEL;
-    event = p->create_event();
-    if (epoll_ctl(this->epfd, op, fd, &event) == -1)
-    {
-        fprintf(stderr, "epoll_ctl mod/del failed: %m");
+    // In this case, it will have called rewatch() itself, or else
+    // it is waiting to be flushed, and must not be retired yet.
+    if (not (p->read or p->write or p->flushing))
+        retire(p);
+    else if (not rewatch(p))
         wipe();
+}
+
+Handler::Status SocketSet::readable(Handler *h)
+{
+    if (__builtin_expect(not stats.enabled, true))
+        return h->on_readable();
+    uint64_t start = stats_clock();
+    Handler::Status rv = h->on_readable();
+    stats.read_ns.record(stats_clock() - start);
+    return rv;
+}
+
+Handler::Status SocketSet::writable(Handler *h)
+{
+    if (__builtin_expect(not stats.enabled, true))
+        return h->on_writable();
+    uint64_t start = stats_clock();
+    Handler::Status rv = h->on_writable();
+    stats.write_ns.record(stats_clock() - start);
+    return rv;
+}
+
+void SocketSet::set_stats_interval(std::chrono::milliseconds t)
+{
+    stats_interval = t;
+    stats.enabled = t.count() > 0;
+    stats.clear();
+    if (stats.enabled)
+        timers.schedule(stats_timer, t);
+    else
+        timers.cancel(stats_timer);
+}
+
+void SocketSet::report_stats()
+{
+    fprintf(stderr, "stats for set %p, over %lld ms:\n",
+            static_cast<void *>(this), (long long)stats_interval.count());
+    stats.print(stderr);
+    stats.clear();
+    timers.schedule(stats_timer, stats_interval);
+}
+
+void SocketSet::handle_mailbox()
+{
+    // Reset the counter *before* taking the queue, so that anything
+    // posted after the swap is guaranteed another wakeup.
+    uint64_t count;
+    if (::read(wakefd, &count, sizeof(count)) == -1 and errno != EAGAIN)
+        fprintf(stderr, "eventfd read failed: %m\n");
+
+    std::vector<std::function<void()>> todo;
+    {
+        std::lock_guard<std::mutex> guard(mailbox_lock);
+        todo.swap(mailbox);
+    }
+    for (auto& f : todo)
+        f();
+}
+
+void SocketSet::set_busy_poll(std::chrono::microseconds t)
+{
+    busy_poll = t;
+    if (uring)
+        // it has nothing like this; spinning on the ring will have to do
         return;
+    epoll_params params {};
+    params.busy_poll_usecs = t.count();
+    params.prefer_busy_poll = t.count() > 0;
+    if (ioctl(epfd, EPIOCSPARAMS, &params) == -1 and t.count() > 0)
+        fprintf(stderr, "epoll busy polling not available, only spinning: %m\n");
+}
+
+Handler *SocketSet::find(uint64_t key)
+{
+    size_t fd = uint32_t(key);
+    Handler *h = fd < sockets.size() ? sockets[fd].get() : nullptr;
+    return h and h->key() == key ? h : nullptr;
+}
+
+SocketSet *SocketSet::current()
+{
+    return current_set;
+}
+
+bool SocketSet::hand_over(std::vector<Handover> *out)
+{
+    if (uring)
+        return false;
+    for (const std::unique_ptr<Handler>& h : sockets)
+    {
+        Handover item;
+        if (h and h->hand_over(&item))
+            out->push_back(std::move(item));
     }
-    if (op == EPOLL_CTL_DEL) // not (read or write)
-        sockets.erase(it);
+    return true;
+}
+
+void SocketSet::post(std::function<void()> f)
+{
+    {
+        std::lock_guard<std::mutex> guard(mailbox_lock);
+        bool was_empty = mailbox.empty();
+        mailbox.push_back(std::move(f));
+        // if it wasn't empty, a wakeup is already pending
+        if (not was_empty)
+            return;
+    }
+    uint64_t one = 1;
+    if (::write(wakefd, &one, sizeof(one)) == -1)
+        fprintf(stderr, "eventfd write failed: %m\n");
 }
 
 void SocketSet::poll(std::chrono::milliseconds timeout)
 {
+    SocketSet *outer = current_set;
+    current_set = this;
+    std::chrono::milliseconds next = timers.next_timeout();
+    if (next.count() >= 0 and (timeout.count() < 0 or next < timeout))
+        timeout = next;
+    if (uring)
+    {
+        // it advances the timers itself
+        if (not uring->wait(timeout))
+            wipe();
+        graveyard.clear();
+        wiped_uring.reset();
+        current_set = outer;
+        return;
+    }
+    // anything written since the last poll()
+    flush();
     constexpr static int MAX_EVENTS = 256;
     epoll_event events[MAX_EVENTS];
     int n = MAX_EVENTS;
     while (true)
     {
-        n = epoll_wait(epfd, events, MAX_EVENTS, timeout.count());
+        auto check = [&]()
+        {
+            n = epoll_wait(epfd, events, MAX_EVENTS, 0);
+            return n != 0;
+        };
+        if (not spin(&timeout, check))
+            n = epoll_wait(epfd, events, MAX_EVENTS, timeout.count());
         if (n == -1)
         {
             fprintf(stderr, "epoll_wait(): %m\n");
             wipe();
-            return;
+            break;
+        }
+        if (__builtin_expect(stats.enabled, false))
+        {
+            ++stats.waits;
+            stats.events.record(n);
+            if (n == MAX_EVENTS)
+                ++stats.full;
         }
+        // before the handlers, so they see a fresh now()
+        timers.advance();
 
         for (int i = 0; i < n; ++i)
             this->handle_event(events[i]);
+        // Coalesce all the replies from this batch into one writev()
+        // per connection, before waiting again.
+        flush();
 
         if (__builtin_expect(n != MAX_EVENTS, true))
             break;
@@ -279,6 +754,8 @@ void SocketSet::poll(std::chrono::milliseconds timeout)
         // for the rest don't wait for any time
         timeout = std::chrono::milliseconds::zero();
     }
+    graveyard.clear();
+    current_set = outer;
 }
 
 void SocketSet::poll()
@@ -287,32 +764,195 @@ void SocketSet::poll()
     poll(std::chrono::milliseconds(-1));
 }
 
-int _create_listen_socket(const sockaddr *addr, socklen_t addr_len)
+ReactorGroup::ReactorGroup(size_t n, Backend backend)
+: sets()
+, first_cpu(-1)
 {
-    int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    for (size_t i = 0; i < n; ++i)
+        sets.emplace_back(new SocketSet(backend));
+}
+
+size_t ReactorGroup::size()
+{
+    return sets.size();
+}
+
+SocketSet& ReactorGroup::operator[](size_t i)
+{
+    return *sets[i];
+}
+
+void ReactorGroup::pin(int first)
+{
+    first_cpu = first;
+}
+
+static
+void run_reactor(SocketSet *set, int cpu)
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        // (the calling thread, not the whole process)
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+            fprintf(stderr, "Failed to pin a reactor to CPU %d: %m\n", cpu);
+    }
+    while (*set)
+        set->poll();
+}
+
+void ReactorGroup::run()
+{
+    int cpus = std::max(1u, std::thread::hardware_concurrency());
+    auto cpu = [this, cpus](size_t i)
+    {
+        return first_cpu < 0 ? -1 : int((first_cpu + i) % cpus);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < sets.size(); ++i)
+        threads.emplace_back(run_reactor, sets[i].get(), cpu(i));
+    if (not sets.empty())
+        run_reactor(sets[0].get(), cpu(0));
+    // Note: a set that has become empty may still be posted to,
+    // which is why they are not destroyed until everything is done.
+    for (std::thread& t : threads)
+        t.join();
+}
+
+WorkerPool::WorkerPool(size_t n)
+: lock()
+, wakeup()
+, jobs()
+, stopping()
+, threads()
+{
+    for (size_t i = 0; i < n; ++i)
+        threads.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& t : threads)
+        t.join();
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        wakeup.wait(guard, [this]() { return stopping or not jobs.empty(); });
+        if (jobs.empty())
+            return;
+        std::function<void()> job = std::move(jobs.front());
+        jobs.pop_front();
+        guard.unlock();
+        job();
+        guard.lock();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(std::move(job));
+    }
+    wakeup.notify_one();
+}
+
+void WorkerPool::submit(BufferHandler *to, std::function<std::string()> work)
+{
+    HandlerRef back = to->ref();
+    submit([back, work]()
+            {
+                Segment text = std::make_shared<std::string>(work());
+                back.post([text](Handler *h)
+                        {
+                            static_cast<BufferHandler *>(h)->write(text);
+                        });
+            });
+}
+
+static
+bool set_option(int sock, int level, int name, int value, const char *what)
+{
+    if (setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+    {
+        fprintf(stderr, "setsockopt(%s) failed: %m\n", what);
+        return false;
+    }
+    return true;
+}
+
+int bind_socket(int type, const sockaddr *addr, socklen_t addr_len,
+        const ListenOptions& opts)
+{
+    int sock = socket(addr->sa_family, type | SOCK_NONBLOCK, 0);
     if (sock == -1)
     {
         fprintf(stderr, "socket() failed: %m\n");
         return -1;
     }
 
-    if (bind(sock, addr, addr_len) == -1)
+    // The buffer sizes have to be set before listen(), since they
+    // decide the window scaling offered in the handshake.
+    bool tcp = type == SOCK_STREAM
+        and (addr->sa_family == AF_INET or addr->sa_family == AF_INET6);
+    if ((opts.reuse_port
+            and not set_option(sock, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT"))
+        or (opts.send_buffer
+            and not set_option(sock, SOL_SOCKET, SO_SNDBUF, opts.send_buffer, "SO_SNDBUF"))
+        or (opts.receive_buffer
+            and not set_option(sock, SOL_SOCKET, SO_RCVBUF, opts.receive_buffer, "SO_RCVBUF"))
+        or (tcp and opts.nodelay
+            and not set_option(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY"))
+        or (tcp and opts.defer_accept
+            and not set_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts.defer_accept, "TCP_DEFER_ACCEPT"))
+        or (tcp and opts.fast_open
+            and not set_option(sock, IPPROTO_TCP, TCP_FASTOPEN, opts.fast_open, "TCP_FASTOPEN")))
     {
-        fprintf(stderr, "bind() failed: %m\n");
         close(sock);
         return -1;
     }
 
-    if (listen(sock, SOMAXCONN) == -1)
+    // Unlike the rest, this is only allowed with CAP_NET_ADMIN, and it
+    // all works the same without.
+    int prefer = 1;
+    if (opts.busy_poll
+            and (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                    &opts.busy_poll, sizeof(opts.busy_poll)) == -1
+                or setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                    &prefer, sizeof(prefer)) == -1))
+        fprintf(stderr, "busy polling of sockets not available: %m\n");
+
+    if (bind(sock, addr, addr_len) == -1)
     {
-        fprintf(stderr, "listen() failed: %m\n");
+        fprintf(stderr, "bind() failed: %m\n");
         close(sock);
         return -1;
     }
 
-    if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+    return sock;
+}
+
+int _create_listen_socket(const sockaddr *addr, socklen_t addr_len,
+        ListenOptions opts)
+{
+    int sock = bind_socket(SOCK_STREAM, addr, addr_len, opts);
+    if (sock == -1)
+        return -1;
+
+    if (listen(sock, opts.backlog ? opts.backlog : SOMAXCONN) == -1)
     {
-        fprintf(stderr, "fcntl(O_NONBLOCK) failed: %m\n");
+        fprintf(stderr, "listen() failed: %m\n");
         close(sock);
         return -1;
     }
@@ -320,7 +960,7 @@ int _create_listen_socket(const sockaddr *addr, socklen_t addr_len)
     return sock;
 }
 
-int _create_listen_socket(uint16_t port, IPv4 iface)
+int _create_listen_socket(uint16_t port, IPv4 iface, ListenOptions opts)
 {
     sockaddr_in addr {};
     addr.sin_family = AF_INET;
@@ -328,10 +968,10 @@ int _create_listen_socket(uint16_t port, IPv4 iface)
     addr.sin_addr = iface;
 
     return _create_listen_socket(reinterpret_cast<sockaddr *>(&addr),
-            sizeof(addr));
+            sizeof(addr), opts);
 }
 
-int _create_listen_socket(uint16_t port, IPv6 iface)
+int _create_listen_socket(uint16_t port, IPv6 iface, ListenOptions opts)
 {
     sockaddr_in6 addr {};
     addr.sin6_family = AF_INET6;
@@ -343,13 +983,13 @@ int _create_listen_socket(uint16_t port, IPv6 iface)
         addr.sin6_scope_id = 0;
 
     return _create_listen_socket(reinterpret_cast<sockaddr *>(&addr),
-            sizeof(addr));
+            sizeof(addr), opts);
 }
 
 constexpr size_t UNIX_PATH_MAX = sizeof(sockaddr_un::sun_path);
 static_assert(UNIX_PATH_MAX == 108, "UNIX_PATH_MAX not as documented");
 
-int _create_listen_socket(const_string path)
+int _create_listen_socket(const_string path, ListenOptions opts)
 {
     if (path.size() >= UNIX_PATH_MAX)
     {
@@ -364,27 +1004,92 @@ int _create_listen_socket(const_string path)
     memset(addr.sun_path + path.size(), 0, UNIX_PATH_MAX - path.size());
 
     return _create_listen_socket(reinterpret_cast<sockaddr *>(&addr),
-            sizeof(addr));
+            sizeof(addr), opts);
 }
 
-ListenHandler::ListenHandler(Cb c, uint16_t port, IPv4 iface)
-: Handler(_create_listen_socket(port, iface), true, false)
+// accept() is looped until EAGAIN, unless there is a budget - then
+// it is level-triggered, so that what is left over wakes it up again.
+ListenHandler::ListenHandler(Cb c, uint16_t port, IPv4 iface,
+        ListenOptions opts)
+: Handler(_create_listen_socket(port, iface, opts), true, false,
+        opts.accept_budget ? Trigger::LEVEL : Trigger::EDGE)
+, adder(c)
+, accept_budget(opts.accept_budget)
+, accept_rate(opts.accept_rate)
+, accept_burst(std::max(opts.accept_burst, 1u))
+, tokens()
+, refilled()
+, refill_timer([this]() { this->refill(); })
+{}
+
+ListenHandler::ListenHandler(Cb c, uint16_t port, IPv6 iface,
+        ListenOptions opts)
+: Handler(_create_listen_socket(port, iface, opts), true, false,
+        opts.accept_budget ? Trigger::LEVEL : Trigger::EDGE)
 , adder(c)
+, accept_budget(opts.accept_budget)
+, accept_rate(opts.accept_rate)
+, accept_burst(std::max(opts.accept_burst, 1u))
+, tokens()
+, refilled()
+, refill_timer([this]() { this->refill(); })
 {}
 
-ListenHandler::ListenHandler(Cb c, uint16_t port, IPv6 iface)
-: Handler(_create_listen_socket(port, iface), true, false)
+ListenHandler::ListenHandler(Cb c, const_string path, ListenOptions opts)
+: Handler(_create_listen_socket(path, opts), true, false,
+        opts.accept_budget ? Trigger::LEVEL : Trigger::EDGE)
 , adder(c)
+, accept_budget(opts.accept_budget)
+, accept_rate(opts.accept_rate)
+, accept_burst(std::max(opts.accept_burst, 1u))
+, tokens()
+, refilled()
+, refill_timer([this]() { this->refill(); })
 {}
 
-ListenHandler::ListenHandler(Cb c, const_string path)
-: Handler(_create_listen_socket(path), true, false)
+ListenHandler::ListenHandler(Cb c, int fd, ListenOptions opts)
+: Handler(fd, true, false,
+        opts.accept_budget ? Trigger::LEVEL : Trigger::EDGE)
 , adder(c)
+, accept_budget(opts.accept_budget)
+, accept_rate(opts.accept_rate)
+, accept_burst(std::max(opts.accept_burst, 1u))
+, tokens()
+, refilled()
+, refill_timer([this]() { this->refill(); })
 {}
 
+bool ListenHandler::hand_over(Handover *h)
+{
+    h->fd = this->fd;
+    h->listening = true;
+    return true;
+}
+
+void ListenHandler::on_added()
+{
+    tokens = accept_burst * 1000ull;
+    refilled = now();
+}
+
+// Top up the bucket for the time since the last refill. Accept while
+// there is a whole token, otherwise pause until there will be.
+void ListenHandler::refill()
+{
+    std::chrono::milliseconds t = now();
+    tokens = std::min<uint64_t>(tokens + (t - refilled).count() * accept_rate,
+            accept_burst * 1000ull);
+    refilled = t;
+    pause_reading(tokens < 1000);
+    if (tokens < 1000)
+        schedule(refill_timer, std::chrono::milliseconds(
+                    (1000 - tokens + accept_rate - 1) / accept_rate));
+}
+
 Handler::Status ListenHandler::on_readable()
 {
-    while (true)
+    // pausing (when out of tokens) also stops the loop
+    for (unsigned n = 0; reading() and (not accept_budget or n != accept_budget); ++n)
     {
         sockaddr_storage addr;
         socklen_t addr_len = sizeof(addr);
@@ -403,15 +1108,29 @@ Handler::Status ListenHandler::on_readable()
             return Handler::Status::DROP;
         }
 
-        switch(addr_ptr->sa_family)
-        {
-        case AF_INET:
-        case AF_INET6:
-        case AF_UNIX:
-        default:
-            add_peer(adder(cfd, addr_ptr, addr_len));
-        }
+        accepted(cfd, addr_ptr, addr_len);
     }
+    return Handler::Status::KEEP;
+}
+
+void ListenHandler::accepted(int cfd, const sockaddr *addr, socklen_t addr_len)
+{
+    switch(addr->sa_family)
+    {
+    case AF_INET:
+    case AF_INET6:
+    case AF_UNIX:
+    default:
+        add_peer(adder(cfd, addr, addr_len));
+    }
+
+    if (not accept_rate)
+        return;
+    // Ones the backend already accepted still arrive after pausing,
+    // and are just let in.
+    tokens = tokens >= 1000 ? tokens - 1000 : 0;
+    if (tokens < 1000 and not refill_timer.pending())
+        refill();
 }
 
 Handler::Status ListenHandler::on_writable()
@@ -419,67 +1138,358 @@ Handler::Status ListenHandler::on_writable()
     return Handler::Status::DROP;
 }
 
+Connector::Connector(SocketSet *s, const sockaddr *a, socklen_t len, Cb c,
+        std::chrono::milliseconds min, std::chrono::milliseconds max)
+: set(s)
+, addr()
+, addr_len(std::min<socklen_t>(len, sizeof(addr)))
+, maker(c)
+, min_delay(min)
+, max_delay(max)
+, delay(min)
+, retry_timer([this]() { this->attempt(); })
+{
+    memcpy(&addr, a, addr_len);
+}
+
+void Connector::start()
+{
+    set->post([this]() { this->attempt(); });
+}
+
+void Connector::attempt()
+{
+    const sockaddr *addr_ptr = reinterpret_cast<const sockaddr *>(&addr);
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "socket() failed: %m\n");
+        lost();
+        return;
+    }
+    // Usually EINPROGRESS, and the handler finds out how it went.
+    // (A unix socket says EAGAIN instead, when the backlog is full.)
+    if (connect(fd, addr_ptr, addr_len) == -1 and errno != EINPROGRESS)
+    {
+        fprintf(stderr, "connect(%s) failed: %m\n",
+                sockaddr_to_string(fd, addr_ptr, addr_len).c_str());
+        close(fd);
+        lost();
+        return;
+    }
+    // if it isn't added, it is destroyed, which calls lost()
+    set->add(maker(fd));
+}
+
+void Connector::established()
+{
+    delay = min_delay;
+}
+
+void Connector::lost()
+{
+    set->timers.schedule(retry_timer, delay);
+    delay = std::min(delay * 2, max_delay);
+}
+
+// How many output pieces to hand to a single writev().
+constexpr size_t IOV_BATCH = 64;
+// Bounds of the adaptive read size.
+constexpr size_t MIN_READ = 1024;
+constexpr size_t MAX_READ = 64 * 1024;
+
 BufferHandler::BufferHandler(std::unique_ptr<Parser> p, int fd,
         const_array<uint8_t> connect_message)
-: Handler(fd, true, bool(connect_message)) // write enabled as needed
+: Handler(fd, true, bool(connect_message), // write enabled as needed
+        Trigger::EDGE, // both directions are drained until EAGAIN
+        Writes::EAGER) // and on_writable() just tries writev()
 , inbuf()
-, outbuf(connect_message.begin(), connect_message.end())
+, read_size(4096)
+, outbuf(connect_message)
+, sending()
 , parser(std::move(p))
+, max_input()
+, hung_up()
+, output_low()
+, output_high()
+, output_hard()
+, idle_timeout()
+, line_timeout()
+, last_active()
+, idle_timer([this]() { this->check_idle(); })
+, line_timer([this]() { this->drop(); })
 {
     parser->init(this);
 }
 
+BufferHandler::BufferHandler(std::unique_ptr<Parser> p, const Handover& h)
+: BufferHandler(std::move(p), h.fd, const_string(h.output))
+{
+    inbuf.append(const_string(h.input));
+}
+
+bool BufferHandler::hand_over(Handover *h)
+{
+    // (sending is only for io_uring, which can't hand over)
+    if (hung_up or sending or not parser->save(&h->state))
+        return false;
+    h->fd = this->fd;
+    const_array<uint8_t> in = inbuf.contiguous();
+    h->input.assign(in.begin(), in.end());
+    outbuf.copy_to(&h->output);
+    return true;
+}
+
+void BufferHandler::set_idle_timeout(std::chrono::milliseconds t)
+{
+    idle_timeout = t;
+    last_active = now();
+    if (t.count() > 0)
+        schedule(idle_timer, t);
+    else
+        cancel(idle_timer);
+}
+
+void BufferHandler::set_line_timeout(std::chrono::milliseconds t)
+{
+    line_timeout = t;
+    if (t.count() <= 0 or inbuf.empty())
+        cancel(line_timer);
+    else if (not line_timer.pending())
+        schedule(line_timer, t);
+}
+
+void BufferHandler::set_input_limit(size_t max)
+{
+    max_input = max;
+}
+
+void BufferHandler::set_output_limits(size_t low, size_t high, size_t hard)
+{
+    output_low = low;
+    output_high = high;
+    output_hard = hard;
+    flow_control();
+}
+
+bool BufferHandler::input_full()
+{
+    return max_input and inbuf.size() >= max_input;
+}
+
+bool BufferHandler::output_full(size_t more)
+{
+    return output_hard and outbuf.size() + sending + more > output_hard;
+}
+
+void BufferHandler::flow_control()
+{
+    if (LoopStats *st = stats())
+        st->outbuf.record(outbuf.size() + sending);
+    if (not output_high)
+        return;
+    size_t queued = outbuf.size() + sending;
+    if (queued >= output_high)
+        pause_reading(true);
+    // (and not just not reading(), which is also so once the peer
+    // has shut down its side)
+    else if (queued <= output_low and reading_paused())
+    {
+        pause_reading(false);
+        parser->drained();
+        // handle whatever arrived after pausing
+        if (reading() and not inbuf.empty()
+                and process_input() == Handler::Status::DROP)
+            drop();
+    }
+}
+
+void BufferHandler::on_added()
+{
+    // the timeouts may have been set before there was a set
+    set_idle_timeout(idle_timeout);
+    set_line_timeout(line_timeout);
+    // input that was handed over, which may not be read again
+    if (not inbuf.empty() and process_input() == Handler::Status::DROP)
+        drop();
+}
+
+void BufferHandler::check_idle()
+{
+    std::chrono::milliseconds idle = now() - last_active;
+    if (idle < idle_timeout)
+        schedule(idle_timer, idle_timeout - idle);
+    else
+        drop();
+}
+
 void BufferHandler::write(const_array<uint8_t> b)
 {
     size_t os = outbuf.size();
     size_t ns = b.size();
+    if (output_full(ns))
+    {
+        // too far behind to ever catch up
+        drop();
+        return;
+    }
+    outbuf.append(b);
+    flow_control();
+    // after, since with io_uring this may start sending right away
     if (!os && ns)
         this->enable_write();
-    outbuf.resize(os + ns);
-    std::copy(b.begin(), b.end(), outbuf.begin() + os);
 }
 
-Handler::Status BufferHandler::do_readable()
+void BufferHandler::write(Segment s)
 {
-    while (true)
+    size_t os = outbuf.size();
+    if (s and output_full(s->size()))
     {
-        uint8_t buf[4096];
-        ssize_t r = ::read(fd, buf, sizeof(buf));
+        drop();
+        return;
+    }
+    outbuf.append(std::move(s));
+    flow_control();
+    if (!os && outbuf.size())
+        this->enable_write();
+}
+
+bool BufferHandler::backed_up()
+{
+    return output_high and outbuf.size() + sending >= output_high;
+}
+
+void BufferHandler::hang_up()
+{
+    hung_up = true;
+}
+
+ssize_t BufferHandler::read_some()
+{
+    // Read straight into the input buffer, with scratch space
+    // after it in case this is a bigger burst than expected.
+    uint8_t scratch[MAX_READ];
+    iovec iov[3];
+    size_t n = inbuf.reserve(read_size, iov);
+    size_t room = 0;
+    for (size_t i = 0; i < n; ++i)
+        room += iov[i].iov_len;
+    iov[n].iov_base = scratch;
+    iov[n].iov_len = sizeof(scratch);
+    ssize_t r = ::readv(fd, iov, n + 1);
+    if (r <= 0)
+        return r;
+    if (LoopStats *st = stats())
+        st->add_read(typeid(*parser), r);
+    if (size_t(r) <= room)
+        inbuf.commit(r);
+    else
+    {
+        inbuf.commit(room);
+        inbuf.append(const_array<uint8_t>(scratch, r - room));
+    }
+    // Size the next read by this one: bulk uploads get big reads,
+    // and idle chatters don't keep big buffers around.
+    if (size_t(r) >= read_size)
+        read_size = std::min(read_size * 2, MAX_READ);
+    else if (size_t(r) < read_size / 4)
+        read_size = std::max(read_size / 2, MIN_READ);
+    return r;
+}
+
+Handler::Status BufferHandler::on_readable()
+{
+    // Parse after every read rather than once at EAGAIN, so that
+    // a flood of requests notices its replies backing up in time.
+    // There may be more, but resuming will check again.
+    while (this->reading())
+    {
+        ssize_t r = this->read_some();
         if (r == 0)
             return Handler::Status::DROP;
         if (r == -1)
             return errno == EAGAIN
                 ? Handler::Status::KEEP
                 : Handler::Status::DROP;
-        size_t s = inbuf.size();
-        inbuf.resize(s + r);
-        std::copy(buf, buf + r, inbuf.data() + s);
-        // if I called parse on each iteration, it would probably:
-        // + do less memory allocation
-        // + remove the need for split methods
-        // + behave well when whole packets are read at a time (common)
-        // - behave poorly when packets cross the 4096-byte limit (rare)
-        // - be less icache-friendly, and possibly less dcache-friendly
+        if (this->process_input() == Handler::Status::DROP)
+            return Handler::Status::DROP;
     }
+    return Handler::Status::KEEP;
 }
 
-Handler::Status BufferHandler::on_readable()
+Handler::Status BufferHandler::received(const_array<uint8_t> b)
 {
-    Handler::Status rv = this->do_readable();
-    size_t n = (this->parser)->parse({inbuf.data(), inbuf.size()});
-    inbuf.erase(inbuf.begin(), inbuf.begin() + n);
-    return rv;
+    inbuf.append(b);
+    // Some may still arrive after pausing; it waits until resuming.
+    if (not this->reading())
+        return Handler::Status::KEEP;
+    return this->process_input();
+}
+
+Handler::Status BufferHandler::process_input()
+{
+    last_active = now();
+    size_t n = 0;
+    // A backlog is parsed in slices, so that it stops as soon as
+    // the replies back up. The rest waits until reading resumes.
+    while (this->reading() and not inbuf.empty() and not hung_up)
+    {
+        const_array<uint8_t> all = inbuf.contiguous();
+        size_t slice = std::min(all.size(), MAX_READ);
+        size_t k = (this->parser)->parse(all.head(slice));
+        if (not k and slice < all.size())
+            // a message bigger than a slice
+            k = (this->parser)->parse(all);
+        if (not k)
+            break;
+        inbuf.consume(k);
+        n += k;
+    }
+    if (hung_up)
+    {
+        inbuf.clear();
+        cancel(line_timer);
+        return Handler::Status::DROP;
+    }
+    if (LoopStats *st = stats())
+        st->inbuf.record(inbuf.size());
+    inbuf.shrink(4 * read_size);
+    // (while paused, a big backlog is expected)
+    if (this->reading() and input_full())
+    {
+        // a message longer than we are willing to buffer
+        inbuf.clear();
+        cancel(line_timer);
+        return Handler::Status::DROP;
+    }
+    // The deadline is only pushed back by complete messages,
+    // not by more bytes trickling in.
+    if (inbuf.empty())
+        cancel(line_timer);
+    else if (line_timeout.count() > 0 and (n or not line_timer.pending()))
+        schedule(line_timer, line_timeout);
+    return Handler::Status::KEEP;
 }
 
 Handler::Status BufferHandler::on_writable()
 {
-    ssize_t w = ::write(fd, outbuf.data(), outbuf.size());
-    if (w == -1)
-        return errno == EAGAIN
-            ? Handler::Status::KEEP
-            : Handler::Status::DROP;
-    outbuf.erase(outbuf.begin(), outbuf.begin() + w);
-    return outbuf.empty() ? Handler::Status::DROP : Handler::Status::KEEP;
+    // In edge-triggered mode, a short write does not mean EAGAIN,
+    // so keep going until the kernel actually says so.
+    while (not outbuf.empty())
+    {
+        iovec iov[IOV_BATCH];
+        size_t n = outbuf.gather(iov, IOV_BATCH);
+        ssize_t w = ::writev(fd, iov, n);
+        if (w == -1)
+            return errno == EAGAIN
+                ? Handler::Status::KEEP
+                : Handler::Status::DROP;
+        if (LoopStats *st = stats())
+            st->add_written(typeid(*parser), w);
+        outbuf.consume(w);
+        flow_control();
+    }
+    return Handler::Status::DROP;
 }
 
 void LineHandler::init(BufferHandler *wbh)
@@ -488,32 +1498,160 @@ void LineHandler::init(BufferHandler *wbh)
 }
 
 SentinelParser::SentinelParser(std::unique_ptr<LineHandler> lh, uint8_t s)
-: sentinel(s)
+: SentinelParser(std::move(lh), const_string(reinterpret_cast<const char *>(&s), 1))
+{}
+
+SentinelParser::SentinelParser(std::unique_ptr<LineHandler> lh,
+        const_string d, size_t max)
+: delim(d.begin(), d.end())
+, max_line(max)
 , no_sentinel()
+, discarding()
 , line_handler(std::move(lh))
-{}
+{
+    assert(not delim.empty());
+}
 
 void SentinelParser::init(BufferHandler *wbh)
 {
     line_handler->init(wbh);
 }
 
+bool SentinelParser::save(std::string *state)
+{
+    return line_handler->save(state);
+}
+
 size_t SentinelParser::parse(Bytes bytes)
 {
-    auto search = bytes.begin() + no_sentinel;
-    auto data = bytes.begin();
-    const uint8_t c = sentinel;
+    // Look for the last byte of the delimiter, all at once,
+    // then check that the rest of it comes before.
+    constexpr size_t BATCH = 64;
+    size_t ends[BATCH];
+    const uint8_t *data = bytes.data();
+    const size_t size = bytes.size();
+    const size_t d = delim.size();
+    const uint8_t last = delim.back();
+    // only part of what was searched last time (see process_input())
+    if (size <= no_sentinel)
+        return 0;
+    // where the current line starts
+    size_t line = 0;
+    size_t search = no_sentinel;
     while (true)
     {
-        search = std::find(search, bytes.end(), c);
-        if (search == bytes.end())
+        size_t k = find_bytes(Bytes(data + search, size - search),
+                last, ends, BATCH);
+        for (size_t i = 0; i < k; ++i)
+        {
+            size_t end = search + ends[i] + 1;
+            if (end - line < d
+                    or memcmp(data + end - d, delim.data(), d - 1) != 0)
+                continue;
+            size_t len = end - d - line;
+            if (discarding)
+                discarding = false;
+            else if (max_line and len > max_line)
+                line_handler->overflow();
+            else
+                line_handler->handle(const_string(
+                            reinterpret_cast<const char *>(data + line), len));
+            line = end;
+        }
+        if (k != BATCH)
+            break;
+        search += ends[BATCH - 1] + 1;
+    }
+
+    // The rest is an incomplete line, except that its last d - 1
+    // bytes might yet turn out to be the start of a delimiter.
+    if (max_line and not discarding and size - line >= max_line + d)
+    {
+        line_handler->overflow();
+        discarding = true;
+    }
+    if (discarding and size - line >= d)
+        line = size - (d - 1);
+    no_sentinel = size - line;
+    return line;
+}
+
+void append_length(std::string *out, uint64_t n)
+{
+    while (n >= 0x80)
+    {
+        out->push_back(char((n & 0x7f) | 0x80));
+        n >>= 7;
+    }
+    out->push_back(char(n));
+}
+
+bool take_length(const_array<uint8_t> *b, uint64_t *n)
+{
+    *n = 0;
+    for (size_t i = 0; i != b->size() and i * 7 <= 56; ++i)
+    {
+        uint8_t c = b->begin()[i];
+        *n |= uint64_t(c & 0x7f) << (i * 7);
+        if (not (c & 0x80))
+        {
+            *b = b->cut(i + 1).second;
+            return true;
+        }
+    }
+    return false;
+}
+
+FrameParser::FrameParser(std::unique_ptr<FrameHandler> fh, size_t max)
+: max_frame(max)
+, wbh()
+, frame_handler(std::move(fh))
+{}
+
+void FrameParser::init(BufferHandler *wbh)
+{
+    this->wbh = wbh;
+    frame_handler->init(wbh);
+}
+
+bool FrameParser::save(std::string *state)
+{
+    return frame_handler->save(state);
+}
+
+size_t FrameParser::parse(Bytes bytes)
+{
+    const uint8_t *data = bytes.data();
+    const size_t size = bytes.size();
+    size_t done = 0;
+    while (true)
+    {
+        uint64_t len = 0;
+        size_t i = done;
+        for (unsigned shift = 0; ; shift += 7)
+        {
+            if (i == size)
+                return done;
+            // no sane length needs this many
+            if (shift > 56)
+            {
+                wbh->hang_up();
+                return size;
+            }
+            uint8_t b = data[i++];
+            len |= uint64_t(b & 0x7f) << shift;
+            if (not (b & 0x80))
+                break;
+        }
+        if (max_frame and len > max_frame)
         {
-            no_sentinel = bytes.end() - data;
-            return data - bytes.begin();
+            wbh->hang_up();
+            return size;
         }
-        line_handler->handle(Bytes(data, search - data));
-        ++search;
-        data = search;
+        if (size - i < len)
+            return done;
+        frame_handler->handle_frame(Bytes(data + i, len));
+        done = i + len;
     }
 }
 
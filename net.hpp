@@ -6,26 +6,81 @@
 #include <cstdint>
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
+#include <algorithm>
 #include <chrono>
-#include <map>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "buffer.hpp"
 #include "const_array.hpp"
 #include "ip.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
 
 namespace net
 {
 
 std::string sockaddr_to_string(int fd, const sockaddr *addr, socklen_t);
+// The other way: "1.2.3.4:port", "[::1]:port", or a unix path (which
+// must contain a '/'). Only numeric addresses, so it never blocks.
+bool string_to_sockaddr(const_string s, sockaddr_storage *addr, socklen_t *addr_len);
 
 class SocketSet;
+class Uring;
+class Handler;
+class BufferHandler;
+
+// What a handler passes on to a new process, to carry on with its fd
+// (see handoff.hpp).
+struct Handover
+{
+    int fd;
+    bool listening;
+    // For a connection: what it had read but not yet parsed, what it
+    // had queued but not yet sent, and whatever its parser needs to
+    // be rebuilt (see Parser::save()).
+    std::string input;
+    std::string output;
+    std::string state;
+
+    Handover()
+    : fd(-1)
+    , listening()
+    , input()
+    , output()
+    , state()
+    {}
+};
+
+// A handler, named in a way that other threads can hold on to: it
+// doesn't keep the handler alive, and a later one that gets the same
+// fd has a different generation.
+class HandlerRef
+{
+    SocketSet *set;
+    uint64_t key;
+public:
+    HandlerRef(SocketSet *s=nullptr, uint64_t k=0)
+    : set(s), key(k)
+    {}
+    // Run f with the handler on the thread of its set, unless it is
+    // gone by then. This may be called from any thread.
+    void post(std::function<void(Handler *)> f) const;
+};
 
 class Handler
 {
     friend class SocketSet;
+    friend class Uring;
     epoll_event create_event();
 protected:
     const int fd;
@@ -33,69 +88,458 @@ protected:
 #if 0
     void replace(std::unique_ptr<Handler>);
 #endif
+    // The peer's fd must be its own (e.g. fresh from accept()),
+    // so that closing it is enough to take it out of the set's epoll.
     bool add_peer(std::unique_ptr<Handler>);
+
+    // Timers only work once this handler is in a set.
+    void schedule(Timer& t, std::chrono::milliseconds delay);
+    void cancel(Timer& t);
+    // Cheap, but only as fresh as the last wakeup of the set.
+    std::chrono::milliseconds now();
+    // Stop (or resume) listening for readability, without giving up
+    // on reading like returning DROP from on_readable() does.
+    void pause_reading(bool pause);
+    // Remove this handler from its set (it is destroyed a bit later).
+    // This is for when no event is being handled, e.g. from a timer;
+    // otherwise just return DROP for both reading and writing.
+    void drop();
+    // whether readability should be watched for right now
+    bool reading() { return read and not paused; }
+    // whether pause_reading() is in effect, even if reading is over
+    bool reading_paused() { return paused; }
+    // The set's stats, if it is keeping them.
+    LoopStats *stats();
 private:
     bool read;
     bool write;
+    bool paused;
+    const bool edge;
+    const bool eager;
+    // in the set's list of writes to try at the end of the batch
+    bool flushing;
+    // nobody else has the fd, so closing it unregisters it from epoll
+    bool sole_owner;
+    // the events last given to epoll_ctl(), to skip needless updates
+    uint32_t watched;
+    // distinguishes this handler from earlier ones that had the same fd
+    // (the top 3 bits are always clear, for the backend's use)
+    uint32_t generation;
     SocketSet *set;
+
+    uint64_t key();
 public:
     enum class Status : bool
     {
         DROP,
         KEEP,
     };
-    Handler(int f, bool r, bool w)
-    : fd(f), read(r), write(w), set(NULL)
+    // An EDGE handler promises that on_readable() and on_writable()
+    // keep going until EAGAIN (or until there is nothing left to do),
+    // since it will not be told again about data it left behind.
+    enum class Trigger : bool
+    {
+        LEVEL,
+        EDGE,
+    };
+    // An EAGER handler doesn't mind on_writable() being called before
+    // the fd is known to be writable (it just gets EAGAIN). Then
+    // enable_write() tries writing once at the end of the current
+    // batch of events, and only waits for EPOLLOUT if that falls short,
+    // saving a trip through the kernel (and a wakeup) per reply.
+    enum class Writes : bool
+    {
+        WAIT,
+        EAGER,
+    };
+    Handler(int f, bool r, bool w, Trigger t=Trigger::LEVEL,
+            Writes ws=Writes::WAIT)
+    : fd(f), read(r), write(w), paused(), edge(t == Trigger::EDGE)
+    , eager(ws == Writes::EAGER), flushing(), sole_owner(), watched()
+    , generation(), set(NULL)
     {}
     virtual ~Handler();
+    // Only once it is in a set.
+    HandlerRef ref();
 private:
+    // Called once the handler is in a set.
+    virtual void on_added() {}
+    // Describe the handler, for a new process to take over its fd.
+    // By default it can't be, and just goes away with this process.
+    virtual bool hand_over(Handover *) { return false; }
     virtual Status on_readable() = 0;
     virtual Status on_writable() = 0;
 };
 
+// How a SocketSet waits for events.
+enum class Backend
+{
+    EPOLL,
+    // Falls back to EPOLL if the kernel can't do everything needed.
+    URING,
+};
+
 class SocketSet
 {
     friend class Handler;
+    friend class Uring;
+    friend class Connector;
+    friend class HandlerRef;
     int epfd;
-    std::map<int, std::unique_ptr<Handler>> sockets;
+    // if set, this is used instead of epfd
+    std::unique_ptr<Uring> uring;
+    // wipe() may be called from within the backend
+    std::unique_ptr<Uring> wiped_uring;
+    // must outlive the handlers, which may own timers
+    TimerWheel timers;
+    LoopStats stats;
+    std::chrono::milliseconds stats_interval;
+    Timer stats_timer;
+    std::chrono::microseconds busy_poll;
+    // indexed by fd, so lookup is just a load
+    std::vector<std::unique_ptr<Handler>> sockets;
+    size_t live;
+    uint32_t next_generation;
+    // handlers removed by drop(), destroyed at the end of poll()
+    std::vector<std::unique_ptr<Handler>> graveyard;
+    // keys of EAGER handlers that enabled writing during this batch
+    std::vector<uint64_t> dirty;
+
+    // eventfd that wakes up poll() when another thread posts something
+    int wakefd;
+    std::mutex mailbox_lock;
+    std::vector<std::function<void()>> mailbox;
 
     void handle_event(epoll_event event);
+    // the handler with the key, if it is still here
+    Handler *find(uint64_t key);
+    // on_readable() and on_writable(), timed if stats are enabled
+    Handler::Status readable(Handler *handler);
+    Handler::Status writable(Handler *handler);
+    void report_stats();
+    void handle_mailbox();
+    // Call ready() until it says so, for up to busy_poll, but not past
+    // the timeout, which is left with however long remains. (A template,
+    // so that every wait doesn't build a std::function.)
+    template<class F>
+    bool spin(std::chrono::milliseconds *timeout, F ready);
+    // Called by enable_write(), in place of rewatch().
+    void want_write(Handler *handler);
+    // Try the writes in dirty, and watch for EPOLLOUT if they fall short.
+    void flush();
+    // Tell the backend about a handler, or a change in its interests.
+    bool watch(Handler *handler);
+    bool rewatch(Handler *handler);
+    bool unwatch(Handler *handler);
+    // Destroy a handler that is neither reading nor writing any more.
+    void retire(Handler *handler);
+    void remove(Handler *handler);
 public:
-    SocketSet();
+    SocketSet(Backend backend=Backend::EPOLL);
     ~SocketSet();
     operator bool() const;
     bool add(std::unique_ptr<Handler> handler);
     void wipe();
     void poll();
+    // Returns early if a timer is due first.
     void poll(std::chrono::milliseconds timeout);
+
+    // Everything that can be handed over to a new process, which is
+    // then expected to take over their fds while this one exits.
+    // The handlers are left as they are. This is only for when nothing
+    // is polling the set, and only for epoll (since io_uring may be in
+    // the middle of reading), otherwise it returns false.
+    bool hand_over(std::vector<Handover> *out);
+
+    // The set that is being polled by the calling thread, if any.
+    static SocketSet *current();
+    // Run f on the thread that polls this set, during its next poll().
+    // Unlike everything else here, this may be called from any thread.
+    void post(std::function<void()> f);
+    // Keep stats on the events and handlers, printing them to stderr
+    // (and starting over) this often. Zero (the default) means never,
+    // which costs no more than a predictable branch here and there.
+    void set_stats_interval(std::chrono::milliseconds t);
+    // Before going to sleep in poll(), keep checking for events this
+    // long, and have epoll_wait() busy-poll the network devices of its
+    // sockets (where the kernel can) rather than wait for interrupts.
+    // That burns the CPU while idle, but an event that comes in the
+    // meantime is handled without a wakeup. Zero (the default) means
+    // sleeping straight away.
+    void set_busy_poll(std::chrono::microseconds t);
+};
+
+template<class F>
+bool SocketSet::spin(std::chrono::milliseconds *timeout, F ready)
+{
+    if (busy_poll.count() <= 0 or timeout->count() == 0)
+        return false;
+    std::chrono::nanoseconds limit = busy_poll;
+    if (timeout->count() > 0 and *timeout < limit)
+        limit = *timeout;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds spent;
+    bool found;
+    do
+    {
+        found = ready();
+        spent = std::chrono::steady_clock::now() - start;
+    }
+    while (not found and spent < limit);
+    if (timeout->count() > 0)
+        *timeout = std::max(*timeout - std::chrono::ceil<std::chrono::milliseconds>(spent),
+                std::chrono::milliseconds::zero());
+    if (found and __builtin_expect(stats.enabled, false))
+        ++stats.spun;
+    return found;
+}
+
+// Polls one SocketSet per thread, until they are all empty.
+// Handlers never move between sets, so a connection stays on the
+// thread that accepted it; anything shared between threads must be
+// delivered using SocketSet::post().
+class ReactorGroup
+{
+    std::vector<std::unique_ptr<SocketSet>> sets;
+    int first_cpu;
+public:
+    ReactorGroup(size_t n, Backend backend=Backend::EPOLL);
+    size_t size();
+    SocketSet& operator[](size_t i);
+    // Keep the thread of set i on CPU first + i (wrapping around), so
+    // that its caches stay warm, and it never waits to be scheduled
+    // back in. Negative (the default) leaves that to the kernel.
+    void pin(int first);
+    // The calling thread polls the first set.
+    void run();
+};
+
+// Threads for work that is too slow to do on a reactor, since it
+// would hold up every other connection of the set (e.g. rendering,
+// saving, or thinking for a computer player). Jobs are started in
+// the order they are given, by whichever worker is free.
+class WorkerPool
+{
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<std::function<void()>> jobs;
+    bool stopping;
+    std::vector<std::thread> threads;
+
+    void work();
+public:
+    WorkerPool(size_t n);
+    // Waits for the jobs already given.
+    ~WorkerPool();
+    // This may be called from any thread.
+    void submit(std::function<void()> job);
+    // Run work on a worker, and write what it returns to the connection
+    // (on its own thread), unless it is gone by then.
+    void submit(BufferHandler *to, std::function<std::string()> work);
+};
+
+struct ListenOptions
+{
+    // Allow several sockets (usually one per thread) to listen on
+    // the same address, letting the kernel spread connections between.
+    bool reuse_port;
+    // The length of the queue of connections not yet accepted.
+    // Zero (the default) means SOMAXCONN.
+    int backlog;
+    // Don't wake up for a TCP connection until its first data arrives
+    // (TCP_DEFER_ACCEPT), waiting up to this many seconds. Only for
+    // protocols where the client speaks first. Zero (the default) is off.
+    int defer_accept;
+    // The queue length for TCP Fast Open (TCP_FASTOPEN), letting a
+    // returning client send data with its SYN. Zero (the default) is off.
+    int fast_open;
+
+    // How many connections to accept per wakeup, before giving the
+    // other handlers a turn; the rest wait for the next wakeup.
+    // Zero (the default) means no limit.
+    unsigned accept_budget;
+    // A token bucket: accept at most this many connections per second
+    // on average, or accept_burst at once after a quiet spell. While
+    // it is empty, the listener is paused, and connections wait in the
+    // backlog. Zero (the default) means no limit.
+    unsigned accept_rate;
+    unsigned accept_burst;
+
+    // Options for every accepted connection, which are set on the
+    // listening socket so that accept() copies them. Zero (the default)
+    // leaves the kernel's choice.
+    bool nodelay;
+    int send_buffer;
+    int receive_buffer;
+    // Busy-poll the device for up to this many microseconds when a read
+    // finds nothing (SO_BUSY_POLL, preferring that to interrupts with
+    // SO_PREFER_BUSY_POLL). Raising it takes CAP_NET_ADMIN, so without
+    // that it is skipped with a warning.
+    int busy_poll;
+
+    ListenOptions()
+    : reuse_port()
+    , backlog()
+    , defer_accept()
+    , fast_open()
+    , accept_budget()
+    , accept_rate()
+    , accept_burst()
+    , nodelay()
+    , send_buffer()
+    , receive_buffer()
+    , busy_poll()
+    {}
 };
 
+// A nonblocking socket of the type (e.g. SOCK_STREAM or SOCK_DGRAM)
+// bound to addr, with whichever of the options apply to it.
+int bind_socket(int type, const sockaddr *addr, socklen_t addr_len,
+        const ListenOptions& opts);
+
 class ListenHandler : public Handler
 {
+    friend class Uring;
+
     // TODO replace with a class so I can do overridden versions
     // for IPv4, IPv6, and Unix connections
     typedef std::function<std::unique_ptr<Handler>(int, const sockaddr *, socklen_t)> Cb;
 
     Cb adder;
+    const unsigned accept_budget;
+    const unsigned accept_rate;
+    const unsigned accept_burst;
+    // in thousandths of a connection, so refilling is exact per ms
+    uint64_t tokens;
+    std::chrono::milliseconds refilled;
+    Timer refill_timer;
+
+    void accepted(int cfd, const sockaddr *addr, socklen_t addr_len);
+    void refill();
+    virtual void on_added() override;
+    virtual bool hand_over(Handover *h) override;
 public:
-    ListenHandler(Cb c, uint16_t port, IPv4 iface);
-    ListenHandler(Cb c, uint16_t port, IPv6 iface);
-    ListenHandler(Cb c, const_string unixpath);
+    ListenHandler(Cb c, uint16_t port, IPv4 iface,
+            ListenOptions opts=ListenOptions());
+    ListenHandler(Cb c, uint16_t port, IPv6 iface,
+            ListenOptions opts=ListenOptions());
+    ListenHandler(Cb c, const_string unixpath,
+            ListenOptions opts=ListenOptions());
+    // Take over a socket that is already listening (with all but the
+    // accept_* options already set), e.g. from a handover.
+    ListenHandler(Cb c, int fd, ListenOptions opts=ListenOptions());
     virtual Handler::Status on_readable() override;
     virtual Handler::Status on_writable() override;
 };
 
+// Keeps an outbound connection open, e.g. for links between servers.
+//
+// Each attempt connects without blocking, and hands the fd straight
+// to a handler made by the callback, like an accepted one (a
+// BufferHandler can queue output before the connection is even up,
+// and just drops it if it fails). That handler must call lost()
+// when it goes; then the next attempt waits a delay which doubles
+// each time, up to max_delay, until established() says a connection
+// worked.
+//
+// Everything but start() happens on the thread of the set, and the
+// connector must outlive its connections.
+class Connector
+{
+public:
+    typedef std::function<std::unique_ptr<Handler>(int)> Cb;
+private:
+    SocketSet *set;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    Cb maker;
+    const std::chrono::milliseconds min_delay;
+    const std::chrono::milliseconds max_delay;
+    std::chrono::milliseconds delay;
+    Timer retry_timer;
+
+    void attempt();
+public:
+    Connector(SocketSet *set, const sockaddr *addr, socklen_t addr_len, Cb c,
+            std::chrono::milliseconds min_delay=std::chrono::milliseconds(100),
+            std::chrono::milliseconds max_delay=std::chrono::seconds(30));
+    // Make the first attempt. This may be called from any thread.
+    void start();
+    // The connection is working, so the next one can be quick.
+    void established();
+    // The handler of the connection is gone, so try again later.
+    void lost();
+};
+
 class Parser;
-class BufferHandler : public Handler
+class BufferHandler : public Handler, public Pooled<BufferHandler>
 {
-    std::vector<uint8_t> inbuf;
-    std::vector<uint8_t> outbuf;
+    friend class Uring;
+
+    RingBuffer inbuf;
+    // how much to make room for in inbuf before reading
+    size_t read_size;
+    OutputQueue outbuf;
+    // handed to the backend, but not yet sent
+    size_t sending;
     std::unique_ptr<Parser> parser;
-    Handler::Status do_readable();
+    size_t max_input;
+    // the parser gave up on the input
+    bool hung_up;
+    size_t output_low;
+    size_t output_high;
+    size_t output_hard;
+    std::chrono::milliseconds idle_timeout;
+    std::chrono::milliseconds line_timeout;
+    // Rather than rescheduling on every read, remember when it was,
+    // and check again when the timer actually fires.
+    std::chrono::milliseconds last_active;
+    Timer idle_timer;
+    Timer line_timer;
+    // one read(), returning the same
+    ssize_t read_some();
+    // for backends that do the reading themselves
+    Handler::Status received(const_array<uint8_t> b);
+    Handler::Status process_input();
+    bool input_full();
+    bool output_full(size_t more);
+    // pause or resume reading, according to how much is queued
+    void flow_control();
+    void check_idle();
+    virtual void on_added() override;
+    virtual bool hand_over(Handover *h) override;
 public:
     BufferHandler(std::unique_ptr<Parser> p, int fd,
             const_array<uint8_t> connect_message=nullptr);
+    // Carry on with a connection that was handed over, with its
+    // unparsed input (parsed once it is added) and unsent output.
+    BufferHandler(std::unique_ptr<Parser> p, const Handover& h);
+    // Drop the connection after receiving nothing for this long.
+    // Zero (the default) means never.
+    void set_idle_timeout(std::chrono::milliseconds t);
+    // Drop the connection when an incomplete message has been
+    // sitting in the input buffer for this long (i.e. slowloris).
+    // Zero (the default) means never.
+    void set_line_timeout(std::chrono::milliseconds t);
+    // Stop reading when an incomplete message gets longer than this,
+    // and close the connection once the output is flushed.
+    // Zero (the default) means no limit.
+    void set_input_limit(size_t max);
+    // Stop reading from the peer (so it can't ask for more) while
+    // high bytes or more are waiting to be sent to it, until it is
+    // down to low. A peer that falls hard bytes behind is dropped.
+    // Zero (the default) means no limit.
+    void set_output_limits(size_t low, size_t high, size_t hard);
     void write(const_array<uint8_t> b);
+    // Queue bytes that are shared with other connections.
+    void write(Segment s);
+    // Whether the high mark of output is waiting to be sent,
+    // so reading has stopped until it goes down to the low mark.
+    bool backed_up();
+    // For the parser, when the input makes no sense (so it can't
+    // find where the next message starts): stop reading, and close
+    // the connection once the output is flushed.
+    void hang_up();
     virtual Handler::Status on_readable() override;
     virtual Handler::Status on_writable() override;
 };
@@ -107,32 +551,89 @@ protected:
 public:
     virtual void init(BufferHandler *wbh) = 0;
     virtual size_t parse(Bytes bytes) = 0;
+    // Called when output that backed up (see backed_up()) has gone
+    // down to the low mark, just before parsing resumes.
+    virtual void drained() {}
+    // Append what is needed to rebuild this parser (and its handler)
+    // in a new process, which is up to whoever makes them. By default
+    // it can't be, and the connection is not handed over.
+    virtual bool save(std::string *) { return false; }
     virtual ~Parser() = default;
 };
 
 class LineHandler
 {
     friend class SentinelParser;
+    friend class FrameParser;
 protected:
     BufferHandler *wbh;
 private:
     void init(BufferHandler *wbh);
 public:
     virtual void handle(const_string line) = 0;
+    // Called (once) for a line that was too long, which is discarded.
+    virtual void overflow() {}
+    // For the parser's save(), which just passes it on.
+    virtual bool save(std::string *) { return false; }
     virtual ~LineHandler() {};
 };
 
-class SentinelParser : public Parser
+// Splits the input into lines, which end with a delimiter of one
+// or more bytes (which is not passed on).
+class SentinelParser : public Parser, public Pooled<SentinelParser>
 {
-    const uint8_t sentinel;
+    const std::string delim;
+    const size_t max_line;
+    // how much of the pending input is known not to end a line
     size_t no_sentinel;
+    // the rest of a line that was too long, up to its delimiter
+    bool discarding;
     std::unique_ptr<LineHandler> line_handler;
 public:
     SentinelParser(std::unique_ptr<LineHandler> lh, uint8_t s='\n');
+    // e.g. "\r\n". A line longer than max_line is thrown away,
+    // and overflow() is called instead of handle(). Zero means no limit.
+    SentinelParser(std::unique_ptr<LineHandler> lh, const_string d,
+            size_t max_line=0);
+    virtual void init(BufferHandler *wbh) override;
+    virtual size_t parse(Bytes bytes) override;
+    virtual bool save(std::string *state) override;
+};
+
+// A LineHandler that can also be given binary frames by a FrameParser,
+// for clients that are programs rather than people.
+class FrameHandler : public LineHandler
+{
+public:
+    // The frame is only valid during the call.
+    virtual void handle_frame(const_array<uint8_t> frame) = 0;
+};
+
+// Splits the input into frames, each of which is a length (as a LEB128
+// varint, i.e. 7 bits per byte, least significant first, with the
+// top bit set on all but the last byte), then that many bytes.
+// Nothing is copied; the handler sees straight into the input buffer.
+class FrameParser : public Parser, public Pooled<FrameParser>
+{
+    const size_t max_frame;
+    BufferHandler *wbh;
+    std::unique_ptr<FrameHandler> frame_handler;
+public:
+    // A frame longer than max_frame hangs up, since there is no way to
+    // skip it without reading it all. Zero means no limit.
+    FrameParser(std::unique_ptr<FrameHandler> fh, size_t max_frame=0);
     virtual void init(BufferHandler *wbh) override;
     virtual size_t parse(Bytes bytes) override;
+    virtual bool save(std::string *state) override;
 };
 
+// Lengths as FrameParser reads them (LEB128), for building frames,
+// and for lengths inside frames.
+void append_length(std::string *out, uint64_t n);
+// Take a length from the front of b, or return false if it is cut
+// off or absurd.
+bool take_length(const_array<uint8_t> *b, uint64_t *n);
+
 } // namespace net
 
 #endif // NET_HPP
@@ -0,0 +1,72 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstddef>
+#include <new>
+
+// Gives a class an operator new and delete that recycle its blocks
+// through a free list per thread, instead of going to malloc() for
+// every object. This is for the objects of a connection, which come
+// and go in storms: class Foo : public Bar, public Pooled<Foo>
+//
+// Blocks freed on another thread just join that thread's list.
+// A subclass of a different size gets the normal allocator.
+template<class T>
+class Pooled
+{
+    struct Block
+    {
+        Block *next;
+    };
+    struct FreeList
+    {
+        Block *head;
+        size_t count;
+
+        ~FreeList()
+        {
+            while (head)
+            {
+                Block *b = head;
+                head = b->next;
+                ::operator delete(b);
+            }
+            count = 0;
+        }
+    };
+    // beyond this, a thread gives blocks back to malloc()
+    static constexpr size_t MAX_FREE = 1024;
+    static thread_local FreeList free_list;
+public:
+    static void *operator new(size_t z)
+    {
+        FreeList& l = free_list;
+        if (z != sizeof(T) or not l.head)
+            return ::operator new(z);
+        Block *b = l.head;
+        l.head = b->next;
+        --l.count;
+        return b;
+    }
+
+    static void operator delete(void *p, size_t z)
+    {
+        FreeList& l = free_list;
+        if (z != sizeof(T) or l.count == MAX_FREE)
+        {
+            ::operator delete(p);
+            return;
+        }
+        Block *b = static_cast<Block *>(p);
+        b->next = l.head;
+        l.head = b;
+        ++l.count;
+    }
+};
+
+template<class T>
+thread_local typename Pooled<T>::FreeList Pooled<T>::free_list;
+
+#endif // POOL_HPP
@@ -0,0 +1,104 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "scan.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SCAN_X86 1
+#endif
+
+namespace net
+{
+
+// All of these search p[i, z) and append to out[k, n),
+// returning the new k.
+
+static
+size_t find_bytes_memchr(const uint8_t *p, size_t i, size_t z, uint8_t c,
+        size_t *out, size_t n, size_t k)
+{
+    while (k != n and i != z)
+    {
+        const void *s = memchr(p + i, c, z - i);
+        if (not s)
+            break;
+        i = static_cast<const uint8_t *>(s) - p;
+        out[k++] = i++;
+    }
+    return k;
+}
+
+#ifdef SCAN_X86
+// Store the offsets of the set bits of a comparison mask.
+// Returns false if out filled up first.
+static inline
+bool take_mask(uint32_t mask, size_t base, size_t *out, size_t n, size_t& k)
+{
+    while (mask)
+    {
+        if (k == n)
+            return false;
+        out[k++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return true;
+}
+
+__attribute__((target("sse2")))
+static
+size_t find_bytes_sse2(const uint8_t *p, size_t i, size_t z, uint8_t c,
+        size_t *out, size_t n, size_t k)
+{
+    const __m128i needle = _mm_set1_epi8(char(c));
+    for (; i + 16 <= z; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (not take_mask(mask, i, out, n, k))
+            return k;
+    }
+    return find_bytes_memchr(p, i, z, c, out, n, k);
+}
+
+__attribute__((target("avx2")))
+static
+size_t find_bytes_avx2(const uint8_t *p, size_t i, size_t z, uint8_t c,
+        size_t *out, size_t n, size_t k)
+{
+    const __m256i needle = _mm256_set1_epi8(char(c));
+    for (; i + 32 <= z; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (not take_mask(mask, i, out, n, k))
+            return k;
+    }
+    return find_bytes_sse2(p, i, z, c, out, n, k);
+}
+#endif
+
+typedef size_t (*Finder)(const uint8_t *, size_t, size_t, uint8_t,
+        size_t *, size_t, size_t);
+
+static
+Finder pick_finder()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_bytes_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_bytes_sse2;
+#endif
+    return find_bytes_memchr;
+}
+
+size_t find_bytes(const_array<uint8_t> b, uint8_t c, size_t *out, size_t n)
+{
+    static const Finder finder = pick_finder();
+    return finder(b.data(), 0, b.size(), c, out, n, 0);
+}
+
+} // namespace net
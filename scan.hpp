@@ -0,0 +1,23 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+
+#include "const_array.hpp"
+
+namespace net
+{
+
+// Find the offsets in b of the bytes equal to c, in order, storing
+// at most n of them in out. Returns how many were stored; if that is n,
+// there may be more after out[n - 1].
+//
+// This is where every byte of input gets looked at, so it compares
+// 16 or 32 bytes at a time, depending on what the CPU can do.
+size_t find_bytes(const_array<uint8_t> b, uint8_t c, size_t *out, size_t n);
+
+} // namespace net
+
+#endif // SCAN_HPP
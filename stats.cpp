@@ -0,0 +1,137 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "stats.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <cxxabi.h>
+
+namespace net
+{
+
+Histogram::Histogram()
+{
+    clear();
+}
+
+uint64_t Histogram::percentile(double q) const
+{
+    uint64_t want = q * count;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < 65; ++i)
+    {
+        seen += buckets[i];
+        if (seen > want or seen == count)
+        {
+            if (i == 0)
+                return 0;
+            uint64_t top = i == 64 ? ~uint64_t(0) : (uint64_t(1) << i) - 1;
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void Histogram::clear()
+{
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    sum = 0;
+    max = 0;
+}
+
+void Histogram::print(FILE *out, const char *name) const
+{
+    if (not count)
+    {
+        fprintf(out, "  %-14s none\n", name);
+        return;
+    }
+    fprintf(out, "  %-14s n=%llu mean=%llu p50<=%llu p99<=%llu p99.9<=%llu max=%llu\n",
+            name, (unsigned long long)count,
+            (unsigned long long)(sum / count),
+            (unsigned long long)percentile(0.5),
+            (unsigned long long)percentile(0.99),
+            (unsigned long long)percentile(0.999),
+            (unsigned long long)max);
+}
+
+LoopStats::LoopStats()
+: enabled()
+, waits()
+, full()
+, spun()
+, events()
+, read_ns()
+, write_ns()
+, inbuf()
+, outbuf()
+, traffic()
+{}
+
+static
+LoopStats::Traffic& find_traffic(std::vector<LoopStats::Traffic>& v,
+        const std::type_info& type)
+{
+    // there are only ever a couple of types
+    for (LoopStats::Traffic& t : v)
+        if (*t.type == type)
+            return t;
+    v.push_back({&type, 0, 0});
+    return v.back();
+}
+
+void LoopStats::add_read(const std::type_info& type, uint64_t n)
+{
+    find_traffic(traffic, type).read += n;
+}
+
+void LoopStats::add_written(const std::type_info& type, uint64_t n)
+{
+    find_traffic(traffic, type).written += n;
+}
+
+void LoopStats::clear()
+{
+    waits = 0;
+    full = 0;
+    spun = 0;
+    events.clear();
+    read_ns.clear();
+    write_ns.clear();
+    inbuf.clear();
+    outbuf.clear();
+    traffic.clear();
+}
+
+void LoopStats::print(FILE *out) const
+{
+    fprintf(out, "  waits=%llu full=%llu spun=%llu\n",
+            (unsigned long long)waits, (unsigned long long)full,
+            (unsigned long long)spun);
+    events.print(out, "events/wait");
+    read_ns.print(out, "read ns");
+    write_ns.print(out, "write ns");
+    inbuf.print(out, "inbuf bytes");
+    outbuf.print(out, "outbuf bytes");
+    for (const Traffic& t : traffic)
+    {
+        int status;
+        char *name = abi::__cxa_demangle(t.type->name(), nullptr, nullptr, &status);
+        fprintf(out, "  %s: read=%llu written=%llu\n",
+                name ? name : t.type->name(),
+                (unsigned long long)t.read, (unsigned long long)t.written);
+        free(name);
+    }
+}
+
+uint64_t stats_clock()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+} // namespace net
@@ -0,0 +1,83 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+#include <cstdio>
+
+#include <typeinfo>
+#include <vector>
+
+namespace net
+{
+
+// Counts of values by order of magnitude: bucket 0 is for 0, and
+// bucket i for [2**(i-1), 2**i). That is plenty to see the tail,
+// and recording is just a few instructions.
+class Histogram
+{
+    uint64_t buckets[65];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+public:
+    Histogram();
+    void record(uint64_t v)
+    {
+        ++buckets[v ? 64 - __builtin_clzll(v) : 0];
+        ++count;
+        sum += v;
+        if (v > max)
+            max = v;
+    }
+    // An upper bound (within a factor of 2) on the fraction q of values.
+    uint64_t percentile(double q) const;
+    void clear();
+    void print(FILE *out, const char *name) const;
+};
+
+// What a SocketSet has been doing, since the last clear().
+struct LoopStats
+{
+    // Bytes moved by one type of connection. For a BufferHandler,
+    // that's the type of its parser, i.e. the protocol.
+    struct Traffic
+    {
+        const std::type_info *type;
+        uint64_t read;
+        uint64_t written;
+    };
+
+    // Checked before measuring anything; the rest is only
+    // touched when this is set.
+    bool enabled;
+    uint64_t waits;
+    // waits that returned as many events as there was room for,
+    // and so had to go around again without sleeping
+    uint64_t full;
+    // waits that found something while spinning, without sleeping
+    // (see SocketSet::set_busy_poll())
+    uint64_t spun;
+    Histogram events;
+    // time spent in on_readable() and on_writable(), in nanoseconds
+    Histogram read_ns;
+    Histogram write_ns;
+    // bytes waiting in a connection's buffers, after each read or write
+    Histogram inbuf;
+    Histogram outbuf;
+    std::vector<Traffic> traffic;
+
+    LoopStats();
+    void add_read(const std::type_info& type, uint64_t n);
+    void add_written(const std::type_info& type, uint64_t n);
+    void clear();
+    void print(FILE *out) const;
+};
+
+// A monotonic clock in nanoseconds, for measuring handlers.
+uint64_t stats_clock();
+
+} // namespace net
+
+#endif // STATS_HPP
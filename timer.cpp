@@ -0,0 +1,223 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "timer.hpp"
+
+namespace net
+{
+
+Timer::Timer(std::function<void()> cb)
+: TimerLink()
+, wheel()
+, expiry()
+, callback(std::move(cb))
+{}
+
+Timer::~Timer()
+{
+    if (wheel)
+        wheel->cancel(*this);
+}
+
+TimerWheel::TimerWheel()
+: epoch(Clock::now())
+, now()
+, count()
+, slots()
+, occupied()
+{
+    for (auto& level : slots)
+        for (TimerLink& head : level)
+            head.prev = head.next = &head;
+}
+
+TimerWheel::~TimerWheel()
+{
+    // orphan anything still scheduled, so it doesn't come back to us
+    for (auto& level : slots)
+        for (TimerLink& head : level)
+            for (TimerLink *l = head.next; l != &head; l = l->next)
+                static_cast<Timer *>(l)->wheel = nullptr;
+}
+
+void TimerWheel::link(Timer *t)
+{
+    // the lowest level whose current lap contains the expiry
+    unsigned level = 0;
+    while (level < LEVELS
+            and t->expiry >> (BITS * (level + 1)) != now >> (BITS * (level + 1)))
+        ++level;
+    unsigned slot;
+    if (level == LEVELS)
+    {
+        // Too far away: park it in the top slot that will be reached last,
+        // and it will be put back from there.
+        level = LEVELS - 1;
+        slot = ((now >> (BITS * level)) - 1) % SLOTS;
+    }
+    else
+        slot = (t->expiry >> (BITS * level)) % SLOTS;
+
+    TimerLink *head = &slots[level][slot];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    occupied[level] |= uint64_t(1) << slot;
+}
+
+void TimerWheel::unlink(TimerLink *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = nullptr;
+}
+
+// Move the whole list at head into the (empty) list at into.
+void TimerWheel::take(TimerLink *head, TimerLink *into)
+{
+    if (head->next == head)
+    {
+        into->prev = into->next = into;
+        return;
+    }
+    into->next = head->next;
+    into->prev = head->prev;
+    into->next->prev = into;
+    into->prev->next = into;
+    head->prev = head->next = head;
+}
+
+void TimerWheel::schedule(Timer& t, std::chrono::milliseconds delay)
+{
+    if (t.wheel)
+        unlink(&t);
+    else
+        ++count;
+    t.wheel = this;
+    // Everything up to now has already fired.
+    t.expiry = now + (delay.count() > 0 ? delay.count() : 1);
+    link(&t);
+}
+
+void TimerWheel::cancel(Timer& t)
+{
+    if (not t.wheel)
+        return;
+    unlink(&t);
+    t.wheel = nullptr;
+    --count;
+}
+
+std::chrono::milliseconds TimerWheel::elapsed() const
+{
+    return std::chrono::milliseconds(now);
+}
+
+static
+uint64_t rotate_right(uint64_t bits, unsigned n)
+{
+    n %= 64;
+    return n ? bits >> n | bits << (64 - n) : bits;
+}
+
+std::chrono::milliseconds TimerWheel::next_timeout()
+{
+    if (not count)
+        return std::chrono::milliseconds(-1);
+
+    uint64_t best = UINT64_MAX;
+    for (unsigned level = 0; level < LEVELS; ++level)
+    {
+        // The current slot of each level has already been dealt with,
+        // so look at the following ones in the order they come up.
+        unsigned current = (now >> (BITS * level)) % SLOTS;
+        uint64_t bits = rotate_right(occupied[level], current + 1);
+        while (bits)
+        {
+            unsigned k = __builtin_ctzll(bits);
+            unsigned slot = (current + 1 + k) % SLOTS;
+            TimerLink *head = &slots[level][slot];
+            if (head->next == head)
+            {
+                // everything there was cancelled
+                occupied[level] &= ~(uint64_t(1) << slot);
+                bits &= bits - 1;
+                continue;
+            }
+            uint64_t when = ((now >> (BITS * level)) + 1 + k) << (BITS * level);
+            if (when < best)
+                best = when;
+            break;
+        }
+    }
+
+    auto clock = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now() - epoch).count();
+    if (best <= uint64_t(clock))
+        return std::chrono::milliseconds::zero();
+    return std::chrono::milliseconds(best - clock);
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+    unsigned slot = (now >> (BITS * level)) % SLOTS;
+    occupied[level] &= ~(uint64_t(1) << slot);
+    TimerLink list;
+    take(&slots[level][slot], &list);
+    while (list.next != &list)
+    {
+        Timer *t = static_cast<Timer *>(list.next);
+        unlink(t);
+        link(t);
+    }
+}
+
+void TimerWheel::fire()
+{
+    unsigned slot = now % SLOTS;
+    occupied[0] &= ~(uint64_t(1) << slot);
+    // Callbacks may schedule or cancel anything, including other timers
+    // in this list (that's why it is a list of its own now).
+    TimerLink list;
+    take(&slots[0][slot], &list);
+    while (list.next != &list)
+    {
+        Timer *t = static_cast<Timer *>(list.next);
+        unlink(t);
+        if (t->expiry > now)
+        {
+            // was parked, being too far away
+            link(t);
+            continue;
+        }
+        t->wheel = nullptr;
+        --count;
+        // Note: this may destroy t.
+        t->callback();
+    }
+}
+
+void TimerWheel::advance()
+{
+    uint64_t target = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now() - epoch).count();
+    while (now < target)
+    {
+        if (not count)
+        {
+            now = target;
+            break;
+        }
+        ++now;
+        // Higher levels first, since they cascade into lower ones.
+        unsigned top = 0;
+        while (top + 1 < LEVELS
+                and not (now & ((uint64_t(1) << (BITS * (top + 1))) - 1)))
+            ++top;
+        for (unsigned level = top; level > 0; --level)
+            cascade(level);
+        fire();
+    }
+}
+
+} // namespace net
@@ -0,0 +1,94 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+
+#include <chrono>
+#include <functional>
+
+namespace net
+{
+
+class TimerWheel;
+
+struct TimerLink
+{
+    TimerLink *prev;
+    TimerLink *next;
+};
+
+// A timer that can be scheduled and cancelled repeatedly.
+// It is linked directly into the wheel, so neither costs an allocation,
+// and destroying it cancels it.
+class Timer : private TimerLink
+{
+    friend class TimerWheel;
+
+    TimerWheel *wheel;
+    uint64_t expiry;
+    std::function<void()> callback;
+
+    Timer(const Timer&) = delete;
+    Timer& operator = (const Timer&) = delete;
+public:
+    Timer(std::function<void()> cb);
+    ~Timer();
+    bool pending() const { return wheel; }
+};
+
+// A hierarchical timing wheel with a resolution of 1 millisecond.
+// Insertion and cancellation are O(1); advancing is O(1) per tick
+// plus the cost of the timers that actually fire (or cascade).
+//
+// Each level has 64 slots, each spanning 64 times as many ticks
+// as a slot of the level below. A timer goes in the lowest level
+// whose current lap it falls into, and moves down a level each time
+// the level below it wraps around.
+class TimerWheel
+{
+    typedef std::chrono::steady_clock Clock;
+
+    constexpr static unsigned LEVELS = 4;
+    constexpr static unsigned BITS = 6;
+    constexpr static unsigned SLOTS = 1 << BITS;
+
+    Clock::time_point epoch;
+    // in ticks since epoch; everything before this has fired
+    uint64_t now;
+    size_t count;
+    // heads of circular lists
+    TimerLink slots[LEVELS][SLOTS];
+    // which slots may be nonempty (cancelling does not clear them)
+    uint64_t occupied[LEVELS];
+
+    void link(Timer *t);
+    static void unlink(TimerLink *t);
+    static void take(TimerLink *head, TimerLink *into);
+    void cascade(unsigned level);
+    void fire();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator = (const TimerWheel&) = delete;
+public:
+    TimerWheel();
+    ~TimerWheel();
+
+    // (Re)schedule t to fire delay after the last advance().
+    void schedule(Timer& t, std::chrono::milliseconds delay);
+    void cancel(Timer& t);
+
+    // Time since the wheel was created, as of the last advance().
+    // This is cheap, unlike asking the clock.
+    std::chrono::milliseconds elapsed() const;
+    // How long until something needs to happen, or -1 if nothing does.
+    // It may be earlier than any timer, if timers need to cascade.
+    std::chrono::milliseconds next_timeout();
+    // Catch up with the clock, firing everything that is due.
+    void advance();
+};
+
+} // namespace net
+
+#endif // TIMER_HPP
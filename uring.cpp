@@ -0,0 +1,695 @@
+// Copyright 2012 Ben Longbons
+// GPL3+
+#include "uring.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <typeinfo>
+#include <utility>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "net.hpp"
+
+namespace net
+{
+
+constexpr unsigned RING_ENTRIES = 256;
+// Kernel-chosen receive buffers, shared by every connection in the set.
+constexpr unsigned BUF_COUNT = 256;
+constexpr unsigned BUF_SIZE = 4096;
+constexpr unsigned short BUF_GROUP = 0;
+
+constexpr unsigned OP_SHIFT = 61;
+constexpr uint64_t KEY_MASK = (uint64_t(1) << OP_SHIFT) - 1;
+
+static
+int sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+        const void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static
+int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Multishot recv needs Linux 6.0, and can't be probed for.
+static
+bool kernel_is_new_enough()
+{
+    utsname u;
+    if (uname(&u) == -1)
+        return false;
+    unsigned major = 0, minor = 0;
+    if (sscanf(u.release, "%u.%u", &major, &minor) != 2)
+        return false;
+    return major >= 6;
+}
+
+Uring::Uring(SocketSet *s)
+: set(s)
+, ring_fd(-1)
+, sq_ptr(MAP_FAILED), sq_size()
+, sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), sqes_size()
+, sq_head(), sq_tail(), sq_mask(), sq_entries(), sq_array(), to_submit()
+, cq_head(), cq_tail(), cq_mask(), cqes()
+, buffers(static_cast<uint8_t *>(MAP_FAILED))
+, conns()
+, orphans()
+{}
+
+std::unique_ptr<Uring> Uring::create(SocketSet *s)
+{
+    if (not kernel_is_new_enough())
+        return nullptr;
+    std::unique_ptr<Uring> u(new Uring(s));
+    if (not u->setup())
+        return nullptr;
+    return u;
+}
+
+bool Uring::setup()
+{
+    io_uring_params params {};
+    params.flags = IORING_SETUP_CQSIZE;
+    // multishot operations can produce many completions per submission
+    params.cq_entries = RING_ENTRIES * 8;
+    ring_fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    if (ring_fd == -1)
+    {
+        fprintf(stderr, "io_uring_setup: %m\n");
+        return false;
+    }
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+        | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed)
+        return false;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+    // with IORING_FEAT_SINGLE_MMAP, one mapping covers both rings
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return false;
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(sq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(sq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(sq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(sq + params.cq_off.cqes);
+
+    // check for every opcode we use
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> probe_mem(new char[probe_size]());
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(probe_mem.get());
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+        return false;
+    for (unsigned op : {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+            IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+            IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS})
+    {
+        if (op > probe->last_op
+            or not (probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+
+    buffers = static_cast<uint8_t *>(mmap(nullptr, BUF_COUNT * BUF_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buffers == MAP_FAILED)
+        return false;
+    // All at once; they are given back one at a time.
+    // (Registered buffer rings would save the SQEs, but they are
+    // not available everywhere that multishot recv is.)
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = BUF_COUNT;
+    sqe->addr = reinterpret_cast<uintptr_t>(buffers);
+    sqe->len = BUF_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = OP_PROVIDE << OP_SHIFT;
+    return true;
+}
+
+Uring::~Uring()
+{
+    // closing the ring cancels everything still in flight
+    if (ring_fd != -1)
+        close(ring_fd);
+    if (buffers != MAP_FAILED)
+        munmap(buffers, BUF_COUNT * BUF_SIZE);
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+}
+
+// Hand a receive buffer back to the kernel.
+void Uring::provide(unsigned short bid)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<uintptr_t>(buffers + size_t(bid) * BUF_SIZE);
+    sqe->len = BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = OP_PROVIDE << OP_SHIFT;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail;
+    if (tail - head == sq_entries)
+    {
+        // full, so send what we have without waiting
+        submit(0, std::chrono::milliseconds::zero());
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head == sq_entries)
+            return nullptr;
+    }
+    unsigned index = tail & sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+    return sqe;
+}
+
+bool Uring::submit(unsigned wait, std::chrono::milliseconds timeout)
+{
+    unsigned flags = 0;
+    io_uring_getevents_arg arg {};
+    __kernel_timespec ts {};
+    if (wait)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout.count() >= 0)
+        {
+            ts.tv_sec = timeout.count() / 1000;
+            ts.tv_nsec = timeout.count() % 1000 * 1000000;
+            arg.ts = reinterpret_cast<uintptr_t>(&ts);
+        }
+    }
+    int rv = sys_io_uring_enter(ring_fd, to_submit, wait, flags,
+            wait ? &arg : nullptr, wait ? sizeof(arg) : 0);
+    if (rv == -1)
+    {
+        if (errno == ETIME or errno == EINTR or errno == EBUSY)
+            return true;
+        fprintf(stderr, "io_uring_enter: %m\n");
+        return false;
+    }
+    to_submit -= rv;
+    return true;
+}
+
+Uring::Conn& Uring::conn(Handler *h)
+{
+    size_t fd = h->fd;
+    if (fd >= conns.size())
+        conns.resize(fd + 1);
+    Conn& c = conns[fd];
+    uint64_t key = h->key();
+    if (c.key != key)
+    {
+        // whatever is left belongs to a handler that is gone
+        if (c.send)
+            orphans[c.key | OP_SEND << OP_SHIFT] = std::move(c.outgoing);
+        c = Conn();
+        c.key = key;
+    }
+    return c;
+}
+
+void Uring::arm_poll(Handler *h)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    epoll_event event = h->create_event();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = h->fd;
+    // A multishot poll only fires on wakeups, so it is edge-triggered.
+    // For level-triggered handlers, a oneshot poll is rearmed after
+    // each completion, which checks the current state.
+    if (h->edge)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = event.events & ~EPOLLET;
+    sqe->user_data = h->key() | OP_POLL << OP_SHIFT;
+    conn(h).poll = true;
+}
+
+void Uring::arm_accept(Handler *h)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = h->fd;
+    // A multishot accept takes the whole backlog in one go, which
+    // is too late to pause; with a rate limit, take one at a time.
+    if (not static_cast<ListenHandler *>(h)->accept_rate)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = h->key() | OP_ACCEPT << OP_SHIFT;
+    conn(h).accept = true;
+}
+
+void Uring::arm_recv(Handler *h)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = h->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = h->key() | OP_RECV << OP_SHIFT;
+    conn(h).recv = true;
+}
+
+void Uring::start_send(BufferHandler *bh)
+{
+    Conn& c = conn(bh);
+    if (c.send)
+        // the completion will pick up whatever was written meanwhile
+        return;
+    if (not c.outgoing)
+        c.outgoing.reset(new Sending());
+    Sending& s = *c.outgoing;
+    if (s.data.empty())
+    {
+        // Take the whole output queue, so that more writes can't
+        // change the pieces under the kernel's feet.
+        if (bh->outbuf.empty())
+            return;
+        std::swap(s.data, bh->outbuf);
+        bh->sending = s.data.size();
+    }
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    s.msg = msghdr();
+    s.msg.msg_iov = s.iov;
+    s.msg.msg_iovlen = s.data.gather(s.iov, sizeof(s.iov) / sizeof(s.iov[0]));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = bh->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&s.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = bh->key() | OP_SEND << OP_SHIFT;
+    c.send = true;
+}
+
+void Uring::cancel(uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = (user_data & KEY_MASK) | OP_CANCEL << OP_SHIFT;
+}
+
+bool Uring::watch_mailbox(int fd)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    // edge-triggered is fine, since it is drained on every wakeup
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = EPOLLIN;
+    sqe->user_data = OP_MAILBOX << OP_SHIFT | KEY_MASK;
+    return true;
+}
+
+bool Uring::watch(Handler *h)
+{
+    // Note: h->set is not set yet.
+    Conn& c = conn(h);
+    if (dynamic_cast<ListenHandler *>(h))
+        c.kind = LISTENER;
+    else if (dynamic_cast<BufferHandler *>(h))
+        c.kind = BUFFERED;
+    else
+        c.kind = POLLED;
+    return rewatch(h);
+}
+
+bool Uring::rewatch(Handler *h)
+{
+    Conn& c = conn(h);
+    uint64_t key = h->key();
+    switch (c.kind)
+    {
+    case LISTENER:
+        if (h->reading() and not c.accept)
+            arm_accept(h);
+        if (not h->reading() and c.accept)
+        {
+            cancel(key | OP_ACCEPT << OP_SHIFT);
+            c.accept = false;
+        }
+        return true;
+    case BUFFERED:
+        if (h->reading() and not c.recv)
+            arm_recv(h);
+        if (not h->reading() and c.recv)
+        {
+            cancel(key | OP_RECV << OP_SHIFT);
+            c.recv = false;
+        }
+        if (h->write)
+            start_send(static_cast<BufferHandler *>(h));
+        return true;
+    case POLLED:
+        break;
+    }
+    if (not c.poll)
+    {
+        arm_poll(h);
+        return true;
+    }
+    // change the mask of the existing poll
+    io_uring_sqe *sqe = get_sqe();
+    if (not sqe)
+        return false;
+    epoll_event event = h->create_event();
+    uint64_t user_data = h->key() | OP_POLL << OP_SHIFT;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    if (h->edge)
+        sqe->len |= IORING_POLL_ADD_MULTI;
+    sqe->addr = user_data;
+    sqe->poll32_events = event.events & ~EPOLLET;
+    sqe->user_data = h->key() | OP_CANCEL << OP_SHIFT;
+    return true;
+}
+
+void Uring::unwatch(Handler *h)
+{
+    Conn& c = conn(h);
+    uint64_t key = h->key();
+    if (c.poll)
+        cancel(key | OP_POLL << OP_SHIFT);
+    if (c.accept)
+        cancel(key | OP_ACCEPT << OP_SHIFT);
+    if (c.recv)
+        cancel(key | OP_RECV << OP_SHIFT);
+    if (c.send)
+    {
+        // let it finish, but the buffer must live until then
+        orphans[key | OP_SEND << OP_SHIFT] = std::move(c.outgoing);
+    }
+    c = Conn();
+}
+
+// Like the end of handle_event(), for handlers driven by completions.
+void Uring::finish(Handler *h)
+{
+    if (not (h->read or h->write))
+        set->retire(h);
+}
+
+void Uring::complete(const io_uring_cqe& cqe)
+{
+    Op op = Op(cqe.user_data >> OP_SHIFT);
+    uint64_t key = cqe.user_data & KEY_MASK;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (op == OP_MAILBOX)
+    {
+        if (cqe.res < 0)
+        {
+            fprintf(stderr, "io_uring mailbox poll failed: %s\n", strerror(-cqe.res));
+            set->wipe();
+            return;
+        }
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.u64 = ~uint64_t(0);
+        set->handle_event(event);
+        if (not more)
+            watch_mailbox(set->wakefd);
+        return;
+    }
+
+    if (op == OP_RECV and (cqe.flags & IORING_CQE_F_BUFFER))
+    {
+        // must go back no matter what happened to the handler
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        const uint8_t *data = buffers + size_t(bid) * BUF_SIZE;
+        Handler *h = nullptr;
+        int fd = int(uint32_t(key));
+        if (size_t(fd) < set->sockets.size())
+            h = set->sockets[fd].get();
+        Handler::Status rv = Handler::Status::KEEP;
+        if (h and h->key() == key and cqe.res > 0)
+        {
+            BufferHandler *bh = static_cast<BufferHandler *>(h);
+            LoopStats *st = bh->stats();
+            uint64_t start = 0;
+            if (st)
+            {
+                st->add_read(typeid(*bh->parser), cqe.res);
+                start = stats_clock();
+            }
+            rv = bh->received(const_array<uint8_t>(data, cqe.res));
+            // the set is still there, even if the handler isn't
+            if (st)
+                st->read_ns.record(stats_clock() - start);
+        }
+        provide(bid);
+        if (not h or set->sockets[fd].get() != h or h->key() != key)
+            return;
+        Conn& c = conn(h);
+        if (not more)
+            c.recv = false;
+        if (rv == Handler::Status::DROP)
+        {
+            h->read = false;
+            rewatch(h);
+            finish(h);
+            return;
+        }
+        if (not c.recv and h->reading())
+            arm_recv(h);
+        return;
+    }
+
+    if (op == OP_SEND)
+    {
+        auto it = orphans.find(cqe.user_data);
+        if (it != orphans.end())
+        {
+            orphans.erase(it);
+            return;
+        }
+    }
+
+    if (op == OP_CANCEL)
+        return;
+    if (op == OP_PROVIDE)
+    {
+        if (cqe.res < 0)
+            fprintf(stderr, "io_uring: providing buffers failed: %s\n",
+                    strerror(-cqe.res));
+        return;
+    }
+
+    int fd = int(uint32_t(key));
+    Handler *h = size_t(fd) < set->sockets.size() ? set->sockets[fd].get() : nullptr;
+    if (not h or h->key() != key)
+        // it went away already (and any buffer is an orphan)
+        return;
+    Conn& c = conn(h);
+
+    // The flags below were cleared when it was cancelled,
+    // and something new may have been armed since.
+    if (cqe.res == -ECANCELED)
+        return;
+
+    switch (op)
+    {
+    case OP_POLL:
+        if (not more)
+            c.poll = false;
+        if (cqe.res < 0)
+        {
+            fprintf(stderr, "io_uring poll failed: %s\n", strerror(-cqe.res));
+            set->wipe();
+            return;
+        }
+        {
+            epoll_event event {};
+            // This is the mask of the wakeup, rather than what poll()
+            // would say, and sockets wake up with EPOLLPRI for any
+            // data at all.
+            event.events = cqe.res & ~EPOLLPRI;
+            event.data.u64 = key;
+            set->handle_event(event);
+        }
+        // the multishot poll ended, but the handler still wants it
+        if (not more and set->sockets[fd].get() == h and h->key() == key)
+            arm_poll(h);
+        return;
+    case OP_ACCEPT:
+        if (not more)
+            c.accept = false;
+        if (cqe.res >= 0)
+        {
+            sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            sockaddr *addr_ptr = reinterpret_cast<sockaddr *>(&addr);
+            if (getpeername(cqe.res, addr_ptr, &addr_len) == -1)
+                close(cqe.res);
+            else
+                static_cast<ListenHandler *>(h)->accepted(cqe.res, addr_ptr, addr_len);
+        }
+        else
+        {
+            // like accept4() failing with something other than EAGAIN
+            h->read = false;
+            finish(h);
+            return;
+        }
+        // (accepting may have grown conns, so c is stale)
+        if (not conn(h).accept and h->reading())
+            arm_accept(h);
+        return;
+    case OP_RECV:
+        // no buffer: end of file, or error
+        if (not more)
+            c.recv = false;
+        if (cqe.res == -ENOBUFS)
+        {
+            // every buffer is in use; try again when some are back
+            if (h->reading())
+                arm_recv(h);
+            return;
+        }
+        h->read = false;
+        finish(h);
+        return;
+    case OP_SEND:
+        c.send = false;
+        if (cqe.res < 0)
+        {
+            // like write() failing with something other than EAGAIN
+            c.outgoing->data.clear();
+            static_cast<BufferHandler *>(h)->sending = 0;
+            h->write = false;
+            finish(h);
+            return;
+        }
+        {
+            BufferHandler *bh = static_cast<BufferHandler *>(h);
+            if (LoopStats *st = bh->stats())
+                st->add_written(typeid(*bh->parser), cqe.res);
+            c.outgoing->data.consume(cqe.res);
+            bh->sending = c.outgoing->data.size();
+            start_send(bh);
+            bh->flow_control();
+        }
+        // (flow control may resume parsing, which can grow conns too)
+        if (not conn(h).send and h->write)
+        {
+            // nothing left: the equivalent of on_writable() returning DROP
+            h->write = false;
+            finish(h);
+        }
+        return;
+    default:
+        fprintf(stderr, "io_uring: unknown completion %llx\n",
+                (unsigned long long)cqe.user_data);
+        return;
+    }
+}
+
+bool Uring::wait(std::chrono::milliseconds timeout)
+{
+    unsigned head = *cq_head;
+    bool ready = head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (not ready and set->busy_poll.count() > 0)
+    {
+        // Submit, then watch the tail of the ring, which takes no
+        // system calls, until something turns up or it's time to sleep.
+        if (not submit(0, timeout))
+            return false;
+        auto check = [this, head]()
+        {
+            return head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        };
+        ready = set->spin(&timeout, check);
+    }
+    if (not submit(ready ? 0 : 1, timeout))
+        return false;
+    // before the handlers, so they see a fresh now()
+    set->timers.advance();
+
+    // Completions may be added while handling these; they'll be
+    // picked up next time, like epoll_wait's MAX_EVENTS.
+    head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(set->stats.enabled, false))
+    {
+        // (never full, since the ring itself is the limit)
+        ++set->stats.waits;
+        set->stats.events.record(tail - head);
+    }
+    while (head != tail)
+    {
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        ++head;
+        // release it now, in case handling it needs room
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        complete(cqe);
+        if (set->uring.get() != this)
+            // the set was wiped
+            break;
+    }
+    return true;
+}
+
+} // namespace net
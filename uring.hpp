@@ -0,0 +1,140 @@
+#ifndef URING_HPP
+#define URING_HPP
+// Copyright 2012 Ben Longbons
+// GPL3+
+
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include <linux/io_uring.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "buffer.hpp"
+
+namespace net
+{
+
+class SocketSet;
+class Handler;
+class BufferHandler;
+
+// The io_uring backend of a SocketSet.
+//
+// Listeners use multishot accept, and buffered connections use multishot
+// recv (into buffers provided up front) and send straight from
+// the output buffer, so most events cost no syscalls of their own.
+// Other handlers get a multishot poll, and go through handle_event()
+// just like with epoll.
+//
+// Everything queued while handling one batch of completions is
+// submitted along with the next wait, in a single io_uring_enter().
+class Uring
+{
+    // Stored in the top bits of the user_data, above a Handler::key().
+    enum Op : uint64_t
+    {
+        OP_POLL = 1,
+        OP_ACCEPT = 2,
+        OP_RECV = 3,
+        OP_SEND = 4,
+        OP_CANCEL = 5,
+        OP_PROVIDE = 6,
+        // the mailbox key is all ones anyway
+        OP_MAILBOX = 7,
+    };
+
+    enum Kind
+    {
+        POLLED,
+        LISTENER,
+        BUFFERED,
+    };
+
+    // Output being sent, so none of it may move until the completion.
+    struct Sending
+    {
+        OutputQueue data;
+        msghdr msg;
+        iovec iov[16];
+    };
+
+    // What is in flight for each fd.
+    struct Conn
+    {
+        uint64_t key;
+        Kind kind;
+        bool poll;
+        bool accept;
+        bool recv;
+        bool send;
+        std::unique_ptr<Sending> outgoing;
+    };
+
+    SocketSet *set;
+    int ring_fd;
+
+    // both rings, since we require IORING_FEAT_SINGLE_MMAP
+    void *sq_ptr;
+    size_t sq_size;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    uint8_t *buffers;
+
+    std::vector<Conn> conns;
+    // outgoing buffers of handlers that went away during a send
+    std::map<uint64_t, std::unique_ptr<Sending>> orphans;
+
+    Uring(SocketSet *s);
+    bool setup();
+
+    io_uring_sqe *get_sqe();
+    bool submit(unsigned wait, std::chrono::milliseconds timeout);
+    void provide(unsigned short bid);
+    Conn& conn(Handler *h);
+
+    void arm_poll(Handler *h);
+    void arm_accept(Handler *h);
+    void arm_recv(Handler *h);
+    void start_send(BufferHandler *bh);
+    void cancel(uint64_t user_data);
+
+    void complete(const io_uring_cqe& cqe);
+    void finish(Handler *h);
+
+    Uring(const Uring&) = delete;
+    Uring& operator = (const Uring&) = delete;
+public:
+    // Returns null if the kernel does not support everything we need.
+    static std::unique_ptr<Uring> create(SocketSet *s);
+    ~Uring();
+
+    bool watch_mailbox(int fd);
+    bool watch(Handler *h);
+    bool rewatch(Handler *h);
+    void unwatch(Handler *h);
+    // Submit, wait, and handle completions.
+    // Returns false if the ring is unusable.
+    bool wait(std::chrono::milliseconds timeout);
+};
+
+} // namespace net
+
+#endif // URING_HPP